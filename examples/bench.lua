@@ -0,0 +1,71 @@
+#!/usr/bin/env lua
+-- ================================================================== --
+-- lsmp streaming benchmark            Josh Feng (C) MIT license 2022 --
+-- Usage (lsmp.so in package.cpath, e.g. from src/):
+--      lua ../examples/bench.lua [file.xml ...]
+-- feeds each document by p:parse(chunk) in 512B .. 64KB chunks;
+-- MB/s should hold steady as documents grow (linear time)
+-- ================================================================== --
+local mp = require('lsmp')
+
+local strrep, strsub, strformat = string.rep, string.sub, string.format
+local tinsert, tconcat = table.insert, table.concat
+local clock = os.clock
+-- ================================================================== --
+local chunks = {512, 2048, 8192, 32768, 65536}
+local n = 0 -- events
+local cb = {
+    StartElement = function (p, name, attr) n = n + 1 end;
+    EndElement = function (p, name) n = n + 1 end;
+    CharacterData = function (p, txt) n = n + 1 end;
+    Comment = function (p, txt) n = n + 1 end;
+}
+
+local function synthetic (size, kind) -- {{{ document of about size bytes
+    local unit = ({
+        tags = '<item id="42" name=\'x y\'>text <b>bold</b> &amp; more</item>\n';
+        text = strrep('long text line without markup ', 3)..'\n';
+        open = ' attr="'..strrep('v', 58)..'"\n'; -- one tag spanning the document
+        comment = strrep('comment body -- ', 4)..'\n'; -- one comment spanning the document
+    })[kind]
+    local body = strrep(unit, size // #unit)
+    if kind == 'open' then return '<doc'..body..'/>' end
+    if kind == 'comment' then return '<!--'..body..'-->' end
+    return '<doc>\n'..body..'</doc>\n'
+end -- }}}
+
+local function run (doc, chunk) -- {{{ MB/s
+    local p = mp.new(cb)
+    local t = clock()
+    for i = 1, #doc, chunk do p:parse(strsub(doc, i, i + chunk - 1)) end
+    p:parse()
+    t = clock() - t
+    p:close()
+    return #doc / 1048576 / (t > 0 and t or 1e-9)
+end -- }}}
+
+local function report (name, doc) -- {{{
+    local rate = {}
+    for _, chunk in ipairs(chunks) do tinsert(rate, strformat('%9.1f', run(doc, chunk))) end
+    print(strformat('%-24s %9d', name, #doc)..tconcat(rate))
+end -- }}}
+
+local head = {}
+for _, chunk in ipairs(chunks) do tinsert(head, strformat('%9s', chunk < 1024 and chunk..'B' or (chunk // 1024)..'K')) end
+print(strformat('%-24s %9s', 'document (MB/s)', 'bytes')..tconcat(head))
+
+local files = #arg > 0 and arg or {'../examples/good.xml', '../examples/bad.xml', '../examples/ugly.xml'}
+for _, f in ipairs(files) do
+    local fh = io.open(f, 'r')
+    if fh then
+        local doc = strrep(fh:read('a'), 1000) -- repeated: too small to time alone
+        fh:close()
+        report(f..' x1000', doc)
+    end
+end
+for _, kind in ipairs({'tags', 'text', 'open', 'comment'}) do
+    for _, size in ipairs({1, 4, 16}) do
+        report(kind..' '..size..'MB', synthetic(size * 1048576, kind))
+    end
+end
+-- vim:ts=4:sw=4:sts=4:et:fdm=marker:fdl=1:sbr=--
@@ -0,0 +1,553 @@
+#!/usr/bin/env lua
+-- ================================================================== --
+-- lsmp regression checks              Josh Feng (C) MIT license 2022 --
+-- Usage (lsmp.so in package.cpath, e.g. from src/):
+--      lua ../examples/check.lua      (or: make check)
+-- prints the failed cases; exits 1 if any
+-- ================================================================== --
+local mp = require('lsmp')
+
+local tinsert, tconcat = table.insert, table.concat
+local strformat = string.format
+-- ================================================================== --
+local failed, total = 0, 0
+
+local function check (name, ok, detail) -- {{{
+    total = total + 1
+    if not ok then
+        failed = failed + 1
+        print('FAIL '..name..(detail and '\n'..detail or ''))
+    end
+end -- }}}
+
+local keys = {'Scheme', 'StartElement', 'EndElement', 'CharacterData', 'Comment', 'Extension', 'Closing'}
+
+local function events (doc, opt, chunk) -- {{{ event dump of doc: opt as lsmp.new, chunk 0: parseall
+    local out = {}
+    local cb = {ext = '<?php ?> <%= %>', pairs = true}
+    for k, v in pairs(opt or {}) do cb[k] = v end
+    for _, k in ipairs(keys) do
+        cb[k] = function (p, ...)
+            local t = {k, strformat('@%d,%d,%d', p:pos())}
+            for _, v in ipairs({...}) do
+                if type(v) == 'table' then
+                    local a = {}
+                    for key, val in pairs(v) do tinsert(a, tostring(key)..'='..tostring(val)) end
+                    table.sort(a)
+                    v = '{'..tconcat(a, ' ')..'}'
+                end
+                tinsert(t, tostring(v))
+            end
+            tinsert(out, tconcat(t, ' '))
+        end
+    end
+    local p = mp.new(cb)
+    if (chunk or 0) == 0 then
+        p:parseall(doc)
+    else
+        for i = 1, #doc, chunk do p:parse(doc:sub(i, i + chunk - 1)) end
+        p:parse()
+    end
+    tinsert(out, strformat('end @%d,%d,%d', p:pos()))
+    return tconcat(out, '\n')
+end -- }}}
+
+local function fuzz (atoms, n, size) -- {{{ n random documents of up to size atoms
+    local docs = {}
+    for i = 1, n do
+        local t = {}
+        for j = 1, math.random(1, size) do t[j] = atoms[math.random(#atoms)] end
+        docs[i] = tconcat(t)
+    end
+    return docs
+end -- }}}
+
+local function same (a, b) -- {{{ deep equality of trees
+    if type(a) ~= 'table' or type(b) ~= 'table' then return a == b end
+    for k, v in pairs(a) do if not same(v, b[k]) then return false end end
+    for k in pairs(b) do if a[k] == nil then return false end end
+    return true
+end -- }}}
+
+local dir = (arg and arg[0] or ''):match('^(.*/)') or './' -- of the examples
+local files = {dir..'good.xml', dir..'bad.xml', dir..'ugly.xml'}
+local function read (path) local f = io.open(path, 'rb') ; local s = f:read('a') ; f:close() ; return s end
+
+math.randomseed(1)
+
+-- positions: M_LAZY (0x80) counts on demand, as the eager parser does {{{
+check('pos </>', events('</>', {mode = 0x83}) == events('</>', {mode = 0x03}))
+check('pos </>x\\ny', events('</>x\ny', {mode = 0x83}) == events('</>x\ny', {mode = 0x03}))
+check('pos end', events('<a/>', {mode = 0x03}):match('end @[%d,]+$') == 'end @1,5,5')
+for _, doc in ipairs(fuzz({'<', '>', '</', '/>', '<a', '<b ', ' x="1"', " y='<2>'", 'z', '\n', ' ', '<!--', '-->',
+    '<![CDATA[', ']]>', '<!DOCTYPE html>', '<?xml v="1"?>', '\\<', '"', "'", 'text', '</>', '<br/>', '</a>',
+    '<% x', '%>', '<?php ', '?>', '<script>', '</script>'}, 400, 30)) do
+    for _, mode in ipairs({0, 3}) do
+        for _, chunk in ipairs({0, 1, 5}) do
+            for _, skip in ipairs({false, 'script'}) do
+                local a = events(doc, {mode = mode, skip = skip or nil}, chunk)
+                local b = events(doc, {mode = mode | 0x80, skip = skip or nil}, chunk)
+                check(strformat('pos lazy %q mode %d chunk %d', doc, mode, chunk), a == b, a..'\n--\n'..b)
+            end
+        end
+    end
+end
+-- }}}
+
+-- parseall: in place, as the same document parsed by chunks {{{
+for _, doc in ipairs(fuzz({'<a', '<b ', ' x="1"', " y='<2>'", '>', '/>', '</a>', '</b>', 'text', '\n', ' ', '<!--', '-->',
+    '<![CDATA[', ']]>', '<!DOCTYPE h>', '<?php ', '?>', '<%= ', '%>', '\\<', '\\"', '"', "'", '<br/>', '<_', '_>', '&amp;'},
+    300, 30)) do
+    for _, mode in ipairs({0, 1, 2, 3, 0x83}) do
+        local a = events(doc, {mode = mode})
+        for _, chunk in ipairs({1, 3, 64}) do
+            local b = events(doc, {mode = mode}, chunk)
+            check(strformat('parseall %q mode %d chunk %d', doc, mode, chunk), a == b, a..'\n--\n'..b)
+        end
+    end
+end
+-- }}}
+
+-- skip: the events of the document without the skipped elements {{{
+local function nopos (s) -- without positions, adjacent text as one
+    s = s:gsub(' @[%d,]+', '')
+    local n
+    repeat s, n = s:gsub('(CharacterData [^\n]*)\nCharacterData ', '%1') until n == 0
+    return s
+end
+local skipped = { -- inside svg: markup the parser reads past
+    '<svg title="a>b"/>', "<p t='</svg>'>x</p>", '<!-- <svg> -->', '<![CDATA[</svg>]]>', '<?php echo "</svg>"; ?>',
+    '<svg><svg/></svg>', '<svg a="\\"</svg>"/>', '<a <b>>', '<>', '<!DOCTYPE x>',
+}
+local kept = {'<a>', '</a>', '<b x="1"/>', 'text', '<!-- c -->', '<![CDATA[d]]>'}
+local function tree (depth) -- --> with svg, without
+    local a, b = {}, {}
+    for _ = 1, math.random(0, 4) do
+        local r = math.random()
+        if r < 0.3 and depth < 3 then
+            local x, y = tree(depth + 1)
+            tinsert(a, '<c k="'..depth..'">'..x..'</c>') ; tinsert(b, '<c k="'..depth..'">'..y..'</c>')
+        elseif r < 0.55 then
+            local t = fuzz(skipped, 1, 4)[1]
+            tinsert(a, '<svg w="1">'..t..(math.random() < 0.3 and tree(depth + 1) or '')..'</svg>')
+        else
+            local t = kept[math.random(#kept)]
+            tinsert(a, t) ; tinsert(b, t)
+        end
+    end
+    return tconcat(a), tconcat(b)
+end
+check('skip quoted >', nopos(events('<r><svg><svg title="a>b"/></svg><p>kept</p></r>', {skip = 'svg'})) ==
+    nopos(events('<r><p>kept</p></r>')))
+check('skip comment', nopos(events('<r><svg><!-- <svg> --></svg><p>kept</p></r>', {skip = 'svg'})) ==
+    nopos(events('<r><p>kept</p></r>')))
+check('skip cdata', nopos(events('<r><svg><![CDATA[</svg>]]></svg><p>kept</p></r>', {skip = 'svg'})) ==
+    nopos(events('<r><p>kept</p></r>')))
+for _ = 1, 300 do
+    local x, y = tree(0)
+    x, y = '<r>'..x..'</r>', '<r>'..y..'</r>'
+    for _, mode in ipairs({0, 3, 0x83}) do
+        local b = nopos(events(y, {mode = mode}))
+        for _, chunk in ipairs({0, 1, 5}) do
+            local a = nopos(events(x, {mode = mode, skip = 'svg'}, chunk))
+            check(strformat('skip %q mode %d chunk %d', x, mode, chunk), a == b, a..'\n--\n'..b)
+        end
+    end
+end
+-- }}}
+
+-- pull: p:events gives the events and attributes the handlers get {{{
+local function pulled (doc, opt, chunk) -- as events(doc, opt, chunk); p:pos() is where the scan stopped
+    local out = {}
+    local cb = {ext = '<?php ?> <%= %>', pairs = true}
+    for k, v in pairs(opt or {}) do cb[k] = v end
+    local p = mp.new(cb)
+    local function put (it)
+        for ev, a, b in it do
+            local t = {ev}
+            for _, v in ipairs({a, (ev == 'StartElement' or ev == 'Scheme') and p:attr() or b}) do
+                if type(v) == 'table' then
+                    local s = {}
+                    for key, val in pairs(v) do tinsert(s, tostring(key)..'='..tostring(val)) end
+                    table.sort(s)
+                    v = '{'..tconcat(s, ' ')..'}'
+                end
+                tinsert(t, tostring(v))
+            end
+            tinsert(out, tconcat(t, ' '))
+        end
+    end
+    for i = 1, #doc, (chunk or 0) > 0 and chunk or #doc + 1 do put(p:events(doc:sub(i, i + (chunk or 0) - 1))) end
+    if (chunk or 0) == 0 then put(p:events(doc)) end
+    put(p:events())
+    tinsert(out, strformat('end @%d,%d,%d', p:pos()))
+    return tconcat(out, '\n')
+end
+local docs = fuzz({'<a', '<b ', ' x="1"', " y='<2>'", ' z', ' =', '>', '/>', '</a>', '</b>', 'text', '\n', '<!--',
+    '-->', '<![CDATA[', ']]>', '<!DOCTYPE h [x]>', '<?php ', '?>', '<%= ', '%>', '<br/>', '&amp;'}, 300, 30)
+for _, f in ipairs(files) do tinsert(docs, read(f)) end
+for _, doc in ipairs(docs) do
+    for _, mode in ipairs({0, 3, 0x83}) do
+        for _, prs in ipairs({true, false}) do
+            for _, chunk in ipairs({0, 1, 7}) do
+                local opt = {mode = mode, pairs = prs}
+                local a, b = events(doc, opt, chunk), pulled(doc, opt, chunk) -- the same end
+                check(strformat('pull %q mode %d pairs %s chunk %d', doc:sub(1, 200), mode, prs, chunk),
+                    nopos(a) == nopos(b) and a:match('[^\n]*$') == b:match('[^\n]*$'), a..'\n--\n'..b)
+            end
+        end
+    end
+end
+-- }}}
+
+-- yield: p:close() delivers the events still queued {{{
+do
+    local out = {}
+    local cb = {yield = true}
+    for _, k in ipairs(keys) do
+        cb[k] = function (_, v)
+            tinsert(out, k..' '..tostring(v))
+            if coroutine.isyieldable() then coroutine.yield() end
+        end
+    end
+    local p = mp.new(cb)
+    local co = coroutine.wrap(function () p:parse('<a><b>x</b>y') end)
+    co() ; co() -- suspended in the second handler
+    p:close()
+    check('yield close', tconcat(out, ',') ==
+        'StartElement a,StartElement b,CharacterData x,EndElement /b,CharacterData y,Closing nil', tconcat(out, ','))
+end
+-- }}}
+
+-- lazy: pairs of a proxy makes it, not by the global next {{{
+do
+    local root = mp.lazy('<r><a k="1">x</a><b/></r>')
+    local n, nxt = 0, next
+    next = nil
+    for _ in pairs(root[1]) do n = n + 1 end
+    next = nxt
+    check('lazy pairs', n == 3 and root[1]['.'] == 'r' and root[1][1]['@'].k == '1')
+end
+do
+    local root, arena = mp.lazy('<r><a/><b><a/></b></r>')
+    for _, a in ipairs((arena:find('a'))) do a.x = true end -- made, kept by nothing else
+    collectgarbage() ; collectgarbage()
+    check('lazy made kept', root[1][1].x and root[1][2][1].x)
+end
+-- }}}
+
+-- snapshots: little-endian header, other layouts refused, strings only {{{
+do
+    local path = os.tmpname()
+    local function write (s) local f = io.open(path, 'wb') ; f:write(s) ; f:close() end
+    check('save', mp.save({{['.'] = 'a', ['@'] = {k = 'v', b = true}, 'x'}}, path, 12.5, 300, 0x3f))
+    local s = io.open(path, 'rb'):read('a')
+    check('save header', s:sub(1, 28) == 'LOM2\8\8\4\0'..'\0\0\0\0\0\0\41\64'..'\44\1\0\0\0\0\0\0'..'\63\0\0\0')
+    local t = mp.restore(path, nil, 12.5, 300, 0x3f)
+    check('restore', t and t[1]['.'] == 'a' and t[1][1] == 'x' and t[1]['@'].k == 'v' and t[1]['@'].b == true)
+    check('restore stale', select(2, mp.restore(path, nil, 12.5, 301, 0x3f)) == 'stale')
+    write(s:sub(1, 4)..'\4'..s:sub(6))
+    check('restore layout', not mp.restore(path))
+    write('LOM1'..s:sub(5))
+    check('restore version', not mp.restore(path))
+    check('save number', not pcall(mp.save, {{['.'] = 'a', ['@'] = {k = 1}}}, path))
+    os.remove(path)
+end
+-- }}}
+
+-- load: files on threads as lsmp.dom one by one {{{
+do
+    local roots = mp.load(files, 0x0f, nil, nil, 2)
+    for i, f in ipairs(files) do check('load '..f, same(roots[i], mp.dom(read(f), 0x0f))) end
+    check('load threads without roots', not pcall(mp.load, files, 0x0f, nil, nil, 'two'))
+end
+-- }}}
+
+-- attributes: lsmp.dom, lsmp.lazy and the lom callbacks make the same trees {{{
+do
+    local lom = require('lom')
+    local d = mp.dom('<a =>x</a><b/><c x>', 0x0f)
+    check('attr none paired', same(d[1]['@'], {}) and d[2]['@'] == nil and same(d[3]['@'], {x = true}))
+    for _, txt in ipairs(fuzz({'<a', '<b ', ' x="1"', ' x', " y='<2>'", ' =', '= ', ' "q"', ' =v', '>', '/>', '</a>',
+        '</b>', 'text', ' ', '\n', '<!-- c -->', '<![CDATA[d]]>', '<?php e ?>', '<!DOCTYPE h>', '<br>', '&nbsp;'}, 300, 20)) do
+        for _, mode in ipairs({0x00, 0x0f, 0x3f, 0x7f}) do
+            local o, t = lom('', mode), {}
+            o:parse(txt):parse()
+            for k, v in pairs(o) do t[k] = v end
+            local dom = mp.dom(txt, mode, {br = true})
+            check(strformat('attr dom %q mode %d', txt, mode), same(dom, t))
+            check(strformat('attr lazy %q mode %d', txt, mode), same(mp.lazy(txt, mode, {br = true}), dom))
+        end
+    end
+end
+-- }}}
+
+-- xpath: cached plans, reused between docs, find what a plan compiled anew finds {{{
+local lom = require('lom')
+local xpaths = {'a', 'b', 'c', 'a/b', 'b/a', 'c/c', '/r/a', '/r/b/c', 'a[k=1]', 'b[k]', 'c[k=2]/a', 'a/b/', 'a[2]',
+    '/r/a/1', 'b/c[1]', '/r/c[k=1]/b'}
+local function xml (depth) -- random elements a, b, c
+    local t = {}
+    for _ = 1, math.random(0, 4) do
+        local tag, k = ({'a', 'b', 'c'})[math.random(3)], math.random(0, 2)
+        tinsert(t, '<'..tag..(k > 0 and ' k="'..k..'"' or '')..'>'..(depth < 4 and xml(depth + 1) or 'x')..'</'..tag..'>')
+    end
+    return tconcat(t)
+end
+local function found (doc, path) -- nodes selected, as a plain list
+    local sel, t = doc:select(path), {}
+    for i = 1, #sel do t[i] = sel[i] end
+    return t
+end
+local function fresh (doc, path) -- by a plan compiled anew, the cached ones pushed out
+    for i = 1, 130 do lom.compile('evict'..i) end
+    return found(doc, path)
+end
+local function change (doc, i) -- the i-th change of a doc through lom
+    if i == 1 then doc:select('a'):text('y')
+    elseif i == 2 then doc:select('b'):arrange('c', 1)
+    else doc:remove('/c') end
+end
+do
+    for n = 1, 30 do
+        local txt = '<r>'..xml(0)..'</r><c>'..xml(2)..'</c>'
+        local u, v = lom('', 0x0f), lom('', 0x0f)
+        u:parse(txt):parse()
+        v:parse(txt):parse()
+        for i = 0, 3 do
+            if i > 0 then change(u, i) ; change(v, i) end
+            for _, path in ipairs(xpaths) do
+                local a = fresh(u, path)
+                local plan = lom.compile(path)
+                for _, q in ipairs(xpaths) do found(v, q) end -- every plan used on another doc
+                check(strformat('xpath cached %d %s change %d', n, path, i), same(found(u, path), a) and
+                    same(found(u, plan), a) and same(found(v, path), a))
+            end
+        end
+    end
+end
+-- }}}
+
+-- index: doc:index() and the arena of a lazy doc find what the walk finds {{{
+do
+    local tags = {'a', 'b', 'c', 'a[k=1]', 'b[k]', 'c[k=2]', 'a[k]'}
+    for n = 1, 30 do
+        local txt = '<r>'..xml(0)..'</r><c>'..xml(2)..'</c>'
+        local path = os.tmpname()
+        local f = io.open(path, 'wb') ; f:write(txt) ; f:close()
+        local u, v, w = lom('', 0x0f), lom('', 0x0f), lom(path, 0x10f)
+        u:parse(txt):parse()
+        v:parse(txt):parse()
+        v:index()
+        for i = 0, 3 do
+            if i > 0 then change(u, i) ; change(v, i) ; change(w, i) end
+            for _, tag in ipairs(tags) do
+                local a = found(u, tag)
+                check(strformat('index %d %s change %d', n, tag, i), same(found(v, tag), a) and same(found(w, tag), a))
+            end
+        end
+        os.remove(path)
+        lom.doc[path] = nil -- a later os.tmpname may give the same path
+    end
+end
+-- }}}
+
+-- stream: lom.stream selects what lom selects in the tree, in document order {{{
+do
+    local function dump (t) -- canonical text of a node
+        if type(t) ~= 'table' then return tostring(t) end
+        local a = {}
+        for k, v in pairs(t['@'] or {}) do tinsert(a, ' '..k..'='..tostring(v)) end
+        table.sort(a)
+        a = {'<'..t['.']..tconcat(a)..'>'}
+        for i = 1, #t do tinsert(a, dump(t[i])) end
+        return tconcat(a)..'</>'
+    end
+    local function both (doc, txt, path) -- dumps sorted: select lists breadth first
+        local a, b = {}, {}
+        local p = lom.stream(path, function (node) tinsert(b, dump(node)) end)
+        p:parse(txt) ; p:parse()
+        for _, n in ipairs(found(doc, path)) do tinsert(a, dump(n)) end
+        table.sort(a) ; table.sort(b)
+        return a, b
+    end
+    for _, f in ipairs(files) do
+        for _, path in ipairs({'public', 'system', 'catalog/public', 'iso_15924_entry', 'col', 'catalog',
+            'iso_15924_entry[alpha_4_code=Adlm]', '/iso_15924_entries/iso_15924_entry'}) do
+            local a, b = both(lom(f), read(f), path)
+            check(strformat('stream found %s %s', f, path), #a > 0 or f ~= files[1]) -- all in good.xml
+            check(strformat('stream %s %s', f, path), same(a, b), tconcat(a, '\n')..'\n--\n'..tconcat(b, '\n'))
+        end
+    end
+    for n = 1, 100 do
+        local txt = '<r>'..xml(0)..'</r>'
+        local doc = lom('', 0x0f)
+        doc:parse(txt):parse()
+        for _, path in ipairs({'a', 'b', 'a/b', 'b/a', 'c/c', '/r/a', '/r/b/c', 'a[k=1]', 'b[k]', 'c[k=2]/a',
+            '/r/c[k=1]/b'}) do
+            local a, b = both(doc, txt, path)
+            check(strformat('stream %d %s', n, path), same(a, b), tconcat(a, '\n')..'\n--\n'..tconcat(b, '\n'))
+        end
+    end
+end
+-- }}}
+
+-- drop: the one-pass writer gives what the recursive wXml gave {{{
+do
+    local function xmlstr (s) -- as before, large hostile text by lsmp.encode instead of gzip | base64
+        if s:find('\n') or #s > 1024 then
+            if s:find(']]>') then return '<!-- base64 -i -d | zcat -f -->{{{'..mp.encode(s)..'}}}' end
+            return (s:find('&') or s:find('<') or s:find('>')) and '<![CDATA[\n'..s..']]>' or s
+        end
+        return (s:gsub('&', '&amp;'):gsub('"', '&quot;'):gsub("'", '&apos;'):gsub('<', '&lt;'):gsub('>', '&gt;'))
+    end
+    local function wXml (node) -- the previous writer
+        if type(node) == 'string' then return node:sub(1, 1) ~= '\0' and node or '<!--'..node..'-->' end
+        local res = {}
+        for k, v in pairs(node['@'] or {}) do
+            tinsert(res, k..(type(v) == 'string' and '="'..v:gsub('"', '\\"')..'"' or ''))
+        end
+        res = '<'..node['.']..(#res > 0 and ' '..tconcat(res, ' ') or '')
+        if #node == 0 then return res..' />' end
+        res = {res..'>'}
+        for i = 1, #node do tinsert(res, type(node[i]) == 'table' and wXml(node[i]) or xmlstr(node[i])) end
+        if #res == 2 and #res[2] < 100 and not res[2]:find('\n') then return res[1]..res[2]..'</'..node['.']..'>' end
+        return tconcat(res, '\n'):gsub('\n', '\n  ')..'\n</'..node['.']..'>'
+    end
+    local function drop (o, fxml)
+        local res = {fxml == 1 and '<?xml version="1.0" encoding="UTF-8"?>' or nil}
+        for j = 1, #o do tinsert(res, wXml(o[j])) end
+        return tconcat(res, '\n')
+    end
+    local texts = {'x', 'a & b', 'l1\nl2', ('y'):rep(1100), 'q"<\'>', '\0 c ', 'a <b>\nc', 'x]]>\ny', ('z'):rep(98)}
+    local function tree (depth) -- random lom nodes
+        local t = {['.'] = ({'a', 'b', 'c'})[math.random(3)]}
+        if math.random() < 0.5 then t['@'] = {k = tostring(math.random(9)), q = 'say "hi"', b = true} end
+        for i = 1, math.random(0, depth < 4 and 4 or 0) do
+            t[i] = math.random() < 0.5 and tree(depth + 1) or texts[math.random(#texts)]
+        end
+        return t
+    end
+    for _, f in ipairs(files) do
+        local doc = lom(f)
+        check('drop '..f, doc:drop(1) == drop(doc, 1) and doc:drop(2) == drop(doc, 2))
+    end
+    for n = 1, 300 do
+        local doc = lom({tree(0), math.random() < 0.3 and tree(1) or nil})
+        local a, b, c = doc:drop(n % 2 + 1), drop(doc, n % 2 + 1), {}
+        doc:drop(n % 2 + 1, function (s) tinsert(c, s) end)
+        check('drop '..n, a == b and tconcat(c) == b, a..'\n--\n'..b)
+    end
+end
+-- }}}
+
+-- blocks: lsmp.encode/decode round trip, '{{{H4sI...}}}' text decoded when parsed {{{
+do
+    for _, n in ipairs({0, 1, 100, 1024, 5000, 200000}) do
+        local t = {}
+        for i = 1, n do t[i] = string.char(math.random(0, 255)) end
+        local s = tconcat(t)
+        local b = mp.encode(s)
+        check('encode '..n, b:sub(1, 4) == 'H4sI' and mp.decode(b) == s)
+    end
+    local s = 'line 1\nline <2> & ]]>\n' -- printf .. | gzip -cn | base64 -w 128
+    check('decode gzip', mp.decode('H4sIAAAAAAAAA8vJzEtVMOTKAVE2RnYKagqxsXZcAK/krYQWAAAA') == s)
+    local long = {} -- base64 of many lines
+    for i = 1, 3000 do long[i] = string.char(math.random(32, 126)) end
+    long = tconcat(long)..']]>\n'
+    for _, txt in ipairs({s, long}) do
+        local doc = '<a><!-- base64 -i -d | zcat -f -->{{{ \n'..mp.encode(txt)..'\n}}}</a><b>{{{H4sIjunk}}}</b>'
+        local o = lom('', 0x0f)
+        o:parse(doc):parse()
+        local d, z = mp.dom(doc, 0x0f), mp.lazy(doc, 0x0f)
+        check('unblock '..#txt, d[1][1] == txt and z[1][1] == txt and o[1][1] == txt and d[2][1] == '{{{H4sIjunk}}}')
+        local r = lom('', 0x0f)
+        r:parse(lom({{['.'] = 'a', txt}}):drop(1)):parse()
+        check('unblock drop '..#txt, r[1][1] == txt)
+    end
+end
+-- }}}
+
+-- lom.load: files on threads, one touched parsed again into its doc {{{
+local tmpdir = os.tmpname() -- of linked files
+os.remove(tmpdir)
+os.execute('mkdir '..tmpdir)
+local function put (f, s) local h = io.open(tmpdir..'/'..f, 'wb') ; h:write(s) ; h:close() end
+do
+    local fs = {}
+    for i = 1, 4 do
+        fs[i] = tmpdir..'/load'..i..'.xml'
+        put('load'..i..'.xml', '<r n="'..i..'">'..xml(0)..'</r>')
+    end
+    local ds = lom.load(fs)
+    local first = {}
+    for i, d in ipairs(ds) do first[i] = d[1] ; check('lom.load '..i, same(d[1], mp.dom(read(fs[i]), 0x0f)[1])) end
+    put('load2.xml', '<r n="2">'..xml(0)..'<touched/></r>')
+    lom(true)
+    for i, d in ipairs(ds) do
+        check('lom.load reload '..i, lom.doc[fs[i]] == d and (i == 2) == (d[1] ~= first[i]) and
+            same(d[1], mp.dom(read(fs[i]), 0x0f)[1]))
+    end
+end
+-- }}}
+
+-- xlinks: linked files preloaded; after one is touched only its doc is parsed again {{{
+do
+    put('a.xml', '<a><l xlink:href="b.xml#xpointer(/b/v)"/><m xlink:href="d.xml#xpointer(/d/w)"/></a>')
+    put('b.xml', '<b><v>one</v></b>')
+    put('c.xml', '<c><v>same</v></c>')
+    put('d.xml', '<d><w>dee</w></d>')
+    local a, b, c = lom(tmpdir..'/a.xml'), lom(tmpdir..'/b.xml'), lom(tmpdir..'/c.xml')
+    check('xlink not loaded', lom.doc[tmpdir..'/d.xml'] == nil)
+    lom(true)
+    local a1, c1 = a[1], c[1]
+    check('xlink preload', lom.doc[tmpdir..'/d.xml'] and a[1][1]['&'][1][1] == 'one' and a[1][2]['&'][1][1] == 'dee')
+    put('b.xml', '<b><v>two!</v></b>') -- its size changed
+    lom(true)
+    check('xlink reload', lom.doc[tmpdir..'/b.xml'] == b and b[1][1][1] == 'two!' and a[1][1]['&'][1][1] == 'two!')
+    check('xlink reload only b', a[1] == a1 and c[1] == c1)
+end
+-- }}}
+
+-- index generations: per doc, bumped by the changes made through its selections {{{
+do
+    local lom = require('lom')
+    local a, b = lom('', 0x0f), lom('', 0x0f)
+    a:parse('<r><s><t k="1"/></s><s/></r>'):parse()
+    b:parse('<r><t k="1"/></r>'):parse()
+    a:index() ; b:index()
+    local n = #a:select('t')
+    a:select('s'):arrange('t', 1)
+    check('index after arrange', #a:select('t') == n + 1)
+    b:remove('r')
+    check('index after remove', #b:select('t') == 0 and #a:select('t') == n + 1)
+end
+-- }}}
+
+-- extensions: default and given pairs, closers split across chunks, openers markup if sloppy {{{
+do
+    local function ext (doc, opt) -- events without positions, the same for any chunk size
+        local a = nopos(events(doc, opt))
+        for chunk = 1, 9 do
+            local b = nopos(events(doc, opt, chunk))
+            check(strformat('ext %q chunk %d', doc, chunk), a == b, a..'\n--\n'..b)
+        end
+        return a
+    end
+    check('ext default', ext('<a><?php echo 1; ?>x<%= y %></a>') ==
+        'StartElement a\nExtension ?php echo 1; \nCharacterData x\nExtension %= y \nEndElement /a\nClosing\nend')
+    check('ext none', ext('<a><?php echo 1; ?>x<%= y %></a>', {ext = ''}) ==
+        'StartElement a\nScheme ?php {1=echo 2=1;}\nCharacterData x\nScheme %= {1=y 2=%}\nEndElement /a\nClosing\nend')
+    check('ext given', ext('<a><@ y @ @@ @@@>z @> @@</a>', {ext = '<@ @@>'}) ==
+        'StartElement a\nExtension @ y @ @@ @\nCharacterData z @> @@\nEndElement /a\nClosing\nend')
+    check('ext sloppy', ext('<a><% y %>< b>x</a>', {mode = 2, ext = ''}) ==
+        'StartElement a\nCharacterData <% y %>< b>x\nEndElement /a\nClosing\nend')
+    check('ext sloppy opener', ext('<a><@ y @@><@x @@></a>', {mode = 2, ext = '<@ @@>'}) ==
+        'StartElement a\nExtension @ y \nScheme @x {1=@@}\nEndElement /a\nClosing\nend')
+end
+-- }}}
+
+os.execute('rm -r '..tmpdir)
+print(strformat('%d checks, %d failed', total, failed))
+if failed > 0 then os.exit(1) end
+-- vim:ts=4:sw=4:sts=4:et:fdm=marker:fdl=1:sbr=--
@@ -0,0 +1,222 @@
+/* lsmp threads stress test            Josh Feng (C) MIT license 2022
+** Usage (from src/): make stress && ./stress [threads [rounds]]
+** each thread runs its own parsers (SML_ParserCreate, SML_Parse by chunks, SML_ParserFree)
+** over attribute-heavy documents; every event dump must equal the single-threaded one.
+** Then SML_ParseThreads on 2-8 MB documents, cut inside comments, CDATA, strings, extensions
+** and skipped elements, in every mode: its replayed events must equal SML_ParseBuffer's
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lsmp/lsmp.h"
+
+#define NDOC    8
+#define NCHUNK  6
+#define NBIG    10 /* SML_ParseThreads documents */
+
+static const int chunks[NCHUNK] = {1, 7, 64, 1000, 4096, 0}; /* 0: SML_ParseBuffer */
+
+typedef struct dump { char *s; size_t n, m; } dump; /* events as text */
+
+static void cat (dump *d, const char *s, int len) {
+  if (d->n + len + 2 > d->m) {
+    while (d->n + len + 2 > d->m) d->m = d->m ? d->m * 2 : 4096;
+    d->s = (char *) realloc(d->s, d->m);
+  }
+  memcpy(d->s + d->n, s, len);
+  d->n += len;
+}
+
+static void put (dump *d, const char *s, int len) {
+  cat(d, s, len);
+  d->s[d->n++] = '|';
+}
+
+static void tag (dump *d, const char *ev, SML_Str name, const SML_Str *attrs, int pairs) {
+  put(d, ev, 1);
+  put(d, name.s, name.len);
+  for (; attrs->s; attrs += pairs ? 2 : 1) {
+    put(d, attrs->s, attrs->len);
+    if (pairs) { if (attrs[1].s) put(d, attrs[1].s, attrs[1].len); else put(d, "=", 1); } /* bare key */
+  }
+}
+
+static void f_Start (void *ud, SML_Str name, const SML_Str *attrs) { tag((dump *) ud, "B", name, attrs, 0); }
+static void f_Pairs (void *ud, SML_Str name, const SML_Str *attrs) { tag((dump *) ud, "B", name, attrs, 1); }
+static void f_Scheme (void *ud, SML_Str name, const SML_Str *attrs) { tag((dump *) ud, "S", name, attrs, 0); }
+static void f_End (void *ud, SML_Str name) { put((dump *) ud, "E", 1); put((dump *) ud, name.s, name.len); }
+static void f_Text (void *ud, const char *s, int len) { put((dump *) ud, "T", 1); put((dump *) ud, s, len); }
+static void f_Comment (void *ud, const char *s, int len) { put((dump *) ud, "C", 1); put((dump *) ud, s, len); }
+static void f_Ext (void *ud, SML_Str name, const char *s, int len) {
+  put((dump *) ud, "X", 1);
+  put((dump *) ud, name.s, name.len);
+  put((dump *) ud, s, len);
+}
+static void f_Closing (void *ud) { put((dump *) ud, "Z", 1); }
+
+static char *docs[NDOC];
+static int ldocs[NDOC];
+static dump refs[NDOC][NCHUNK];
+static int rounds = 20;
+
+static SML_Parser parser (dump *d, int mode, int pairs) { /* events into d */
+  SML_Parser p = SML_ParserCreate(d, mode, "<?php ?> <%= %>");
+  if (!p) {
+    fprintf(stderr, "SML_ParserCreate failed\n");
+    exit(2);
+  }
+  p->pairs = (BYTE) pairs;
+  p->fs = p->pairs ? f_Pairs : f_Start;
+  p->fd = f_Scheme;
+  p->fe = f_End;
+  p->ft = f_Text;
+  p->fc = f_Comment;
+  p->fx = f_Ext;
+  p->fz = f_Closing;
+  d->n = 0;
+  return p;
+}
+
+static void parse (dump *d, int k, int chunk) { /* doc k into d, a new parser */
+  SML_Parser p = parser(d, k & 1 ? M_ESCAPE | M_SLOPPY : M_SLOPPY, k & 2);
+  if (!chunk) {
+    SML_ParseBuffer(p, docs[k], ldocs[k]);
+  }
+  else {
+    int i;
+    for (i = 0; i < ldocs[k]; i += chunk) SML_Parse(p, docs[k] + i, ldocs[k] - i < chunk ? ldocs[k] - i : chunk);
+    SML_Parse(p, NULL, 0);
+  }
+  SML_ParserFree(p);
+}
+
+static const char *parts[] = {
+  "<item id=\"%d\" name='n %d' flag k%d=v%d x=\"a>b\" y='c<d'>text %d</item>\n",
+  "<row a=1 b=\"2\" c='3' d e= \"5\" f =6 g=\"\\\"q\\\"\" h=%d/>\n",
+  "<!-- c %d --><![CDATA[<raw %d>]]><?php echo %d; ?>\n",
+  "<t  p1=\"%d\"   p2='%d'\n p3=%d>%d &amp; <b q=\"%d\">bold</b></t>\n",
+};
+
+static char *make (int k, int *len) { /* attribute-heavy document k */
+  size_t m = 1 << 17, n = 0;
+  char *s = (char *) malloc(m);
+  unsigned int seed = (unsigned int) k * 7919u + 1;
+  n += sprintf(s, "<?xml version=\"1.0\"?>\n<doc k=\"%d\">\n", k);
+  while (n + 256 < m - 64) {
+    int i = rand_r(&seed) % 4, v = rand_r(&seed) % 100000;
+    n += sprintf(s + n, parts[i], v, v + 1, v + 2, v + 3, v + 4);
+  }
+  n += sprintf(s + n, "</doc>\n");
+  *len = (int) n;
+  return s;
+}
+
+static char *big (int k, int *len) { /* 2-8 MB, its bulk inside constructs of kind k % 5 */
+  static const char *open[] = {"<!-- ", "<![CDATA[", "<s v=\"", "<?php ", "<svg w='1'>", "<%= "};
+  static const char *close[] = {" -->", "]]>", "\">x</s>", " ?>", "</svg>", " %>"};
+  static const char *fill[] = { /* tags to cut before, and what could end the construct early */
+    "<a x='1'>t</a> -- <b/>\n",
+    "<a x='1'>t</a> ]] ]><b/>\n",
+    "<a x='1'>t</a> = '<b/>'\n",
+    "<a x='1'>t</a> ? > % ><b/>\n",
+    "<svg/><g t=\"</svg>\"/><!-- </svg> --><svg><x/></svg><![CDATA[</svg>]]>\n",
+  };
+  dump d = {NULL, 0, 0};
+  unsigned int seed = (unsigned int) k * 104729u + 3;
+  size_t size = ((size_t) 5 << 19) + ((size_t) 11 << 19) * k / (NBIG - 1); /* 2.5-8 MB, less the last round */
+  char line[512];
+  int kind = k % 5;
+  cat(&d, line, sprintf(line, "<?xml version=\"1.0\"?>\n<doc k=\"%d\">\n", k));
+  while (d.n + 320000 < size) {
+    int i, v, j = 20000 + rand_r(&seed) % 280000; /* bytes of the construct */
+    for (i = rand_r(&seed) % 16; i >= 0; i--) { /* plain markup */
+      v = rand_r(&seed) % 100000;
+      cat(&d, line, sprintf(line, parts[rand_r(&seed) % 4], v, v + 1, v + 2, v + 3, v + 4));
+    }
+    int o = kind == 3 && (rand_r(&seed) & 1) ? 5 : kind; /* <?php ?> or <%= %> */
+    cat(&d, open[o], (int) strlen(open[o]));
+    for (; j > 0; j -= (int) strlen(fill[kind])) cat(&d, fill[kind], (int) strlen(fill[kind]));
+    cat(&d, close[o], (int) strlen(close[o]));
+  }
+  cat(&d, "</doc>\n", 7);
+  *len = (int) d.n;
+  return d.s;
+}
+
+static long threads_check (void) { /* --> number of mismatches */
+  static const int modes[] = {M_STRICT, M_ESCAPE, M_SLOPPY, M_ESCAPE | M_SLOPPY};
+  dump a = {NULL, 0, 0}, b = {NULL, 0, 0};
+  long bad = 0;
+  int k, i, len;
+  for (k = 0; k < NBIG; k++) {
+    char *s = big(k, &len);
+    for (i = 0; i < 4; i++) {
+      SML_Parser p = parser(&a, modes[i], (k + i) & 1);
+      SML_SetSkip(p, "svg");
+      SML_ParseBuffer(p, s, len);
+      SML_ParserFree(p);
+      p = parser(&b, modes[i], (k + i) & 1);
+      SML_SetSkip(p, "svg");
+      SML_ParseThreads(p, s, len, 2 + (k + i) % 7);
+      SML_ParserFree(p);
+      if (a.n != b.n || memcmp(a.s, b.s, a.n)) {
+        fprintf(stderr, "SML_ParseThreads: document %d (%d bytes) mode %d differs\n", k, len, modes[i]);
+        bad++;
+      }
+    }
+    free(s);
+  }
+  free(a.s);
+  free(b.s);
+  return bad;
+}
+
+static void *worker (void *arg) { /* --> number of mismatches */
+  long id = (long) arg, bad = 0;
+  int r, k;
+  dump d = {NULL, 0, 0};
+  for (r = 0; r < rounds; r++) {
+    for (k = 0; k < NDOC; k++) {
+      int c = (int) ((r + k + id) % NCHUNK);
+      parse(&d, k, chunks[c]);
+      if (d.n != refs[k][c].n || memcmp(d.s, refs[k][c].s, d.n)) bad++;
+    }
+  }
+  free(d.s);
+  return (void *) bad;
+}
+
+int main (int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 8, k, c;
+  long i, bad = 0;
+  if (argc > 2) rounds = atoi(argv[2]);
+  if (threads < 1) threads = 1;
+  for (k = 0; k < NDOC; k++) {
+    docs[k] = make(k, ldocs + k);
+    for (c = 0; c < NCHUNK; c++) parse(&refs[k][c], k, chunks[c]); /* single-threaded */
+  }
+  pthread_t *tid = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(tid + i, NULL, worker, (void *) i)) {
+      fprintf(stderr, "pthread_create failed\n");
+      return 2;
+    }
+  }
+  for (i = 0; i < threads; i++) {
+    void *r;
+    pthread_join(tid[i], &r);
+    bad += (long) r;
+  }
+  printf("%d threads x %d rounds x %d documents: %ld mismatched\n", threads, rounds, NDOC, bad);
+  long tbad = threads_check();
+  printf("SML_ParseThreads x %d documents of 2-8 MB x 4 modes: %ld mismatched\n", NBIG, tbad);
+  for (k = 0; k < NDOC; k++) {
+    free(docs[k]);
+    for (c = 0; c < NCHUNK; c++) free(refs[k][c].s);
+  }
+  free(tid);
+  return bad || tbad ? 1 : 0;
+}
+/* vim:ts=2:sw=2:sts=2:et:fdm=marker:fdl=1 */
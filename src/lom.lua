@@ -8,6 +8,7 @@
 --      doc2 = lom('') ; doc2:parse(txt):parse()
 --      lom(true) -- buildxlink
 --      xmltxt = doc2:drop(1)
+--      doc2:drop(1, io.stdout) -- or any function(s)
 -- ================================================================== --
 local class = require('pool') -- https://github.com/josh-feng/pool.git
 local we = require('us') -- working environment
@@ -19,94 +20,92 @@ local tinsert, tremove, tconcat = table.insert, table.remove, table.concat
 local mmin = math.min
 -- ================================================================== --
 local docs = {} -- {{{ doctree for files, user's management
+local srcs = {} -- [file] = {mtime, size, mode} when parsed
+local links = {} -- [xml] = {[file] = true} linked by xml; [0] = {[file] = {[xml] = true}} the reverse
+links[0] = {}
 local singleton = {}
+local lazies = setmetatable({}, {__mode = 'k'}) -- [doc] = {arena, generation} of docs kept by lsmp (mode 0x100)
+-- only aFind runs on the arena; the other walks make the nodes they pass
 local mp = require('lsmp') -- a simple/sloppy SAX to replace lxp
+local view = mp.view -- node as is, or a lazy node read without making it
+
+local function untext (txt) -- text of a '{{{H4sI...}}}' block from xmlstr
+    local b = strmatch(txt, '^%s*{{{%s*(H4sI.*)}}}%s*$')
+    return b and mp.decode(b) or txt
+end
+
+local function callbacks (o, mode) -- {{{ lsmp handlers building dom o; stack kept as upvalue
+    local stack = {o} -- {{}}
+    local cb = {stack = stack}
+
+    cb.Scheme = (mode & 0x10 > 0) and function (p, name, attr) -- {{{ definition/declaration
+        local top = stack[#stack]
+        top['+'] = top['+'] or {}
+        attr[0] = name
+        tinsert(top['+'], attr)
+    end or nil -- }}}
+    cb.StartElement = function (p, name, attr) -- {{{
+        tinsert(singleton[name] and stack[#stack] or stack,
+            {['.'] = name, ['@'] = attr}) -- attr paired by lsmp, nil if none
+    end -- }}}
+    cb.EndElement = function (p, name) -- {{{
+        if singleton[name] then return end
+        if #stack > 1 then -- {o}
+            local element = tremove(stack)
+            tinsert(stack[#stack], element)
+        end
+    end -- }}}
+    cb.CharacterData = (mode & 0x08 > 0) and function (p, txt) -- {{{ clean text
+        txt = strgsub(txt, '&nbsp;', '')
+        if strfind(txt, '%S') then
+            tinsert(stack[#stack], untext(strmatch(txt, '^.*%S')))
+        end
+    end or function (p, txt)
+        tinsert(stack[#stack], untext(txt))
+    end -- }}}
+    cb.Comment = (mode & 0x20 > 0) and function (p, txt) -- {{{
+        tinsert(stack[#stack], '\0'..txt)
+    end or nil -- }}}
+    cb.Extension = (mode & 0x40 > 0) and function (p, name, txt) -- {{{
+        tinsert(stack[#stack], '\0'..name..'\0'..txt)
+    end or nil -- }}}
+    cb.Closing = function (p) -- {{{
+        while #stack > 1 do -- closing unmatched tags
+            local element = tremove(stack)
+            tinsert(stack[#stack], element)
+        end
+    end -- }}}
 
-local function lsmp2domAttr (attr) -- {{{ parse lsmp attr table to dom attr table
-    local k, v
-    for i = 1, #attr do
-        local key, eq, val = strmatch(attr[i], "^([^=]*)(=?)(.*)$")
-        if eq == '' then -- key
-            if v then
-                attr[k] = we.trimq(key)
-                k = false
-            else
-                if k then attr[k] = true end
-                k = key
-            end
-            v = false
-        elseif key == '' and val == '' then -- =
-            v = k and true
-        elseif key == '' then -- =val
-            if k then attr[k] = we.trimq(val) ; k = false
-            else k = we.trimq(val) end
-            v = false
-        else
-            if k then attr[k] = v and '' or true end
-            if val ~= '' then -- key=val
-                attr[key] = we.trimq(val)
-                k = false
-                v = false
-            else -- key=
-                k = key
-                v = true
-            end
+    cb.Events = function (p, ev, n) -- {{{ batch of events from lsmp
+        for i = 1, 3 * n, 3 do
+            local f = cb[ev[i]]
+            if f then f(p, ev[i + 1], ev[i + 2]) end
         end
-        attr[i] = nil -- clean
-    end
-    if k then attr[k] = v and '' or true end
-    return attr
-end -- }}}
+    end -- }}}
 
-local function scheme (p, name, attr) -- {{{ definition/declaration
-    local stack = p:getcallbacks().stack
-    stack[#stack]['+'] = stack[#stack]['+'] or {}
-    attr[0] = name
-    tinsert(stack[#stack]['+'], attr)
-end -- }}}
-local function starttag (p, name, attr) -- {{{
-    local stack = p:getcallbacks().stack
-    tinsert(singleton[name] and stack[#stack] or stack,
-        {['.'] = name, ['@'] = #attr > 0 and lsmp2domAttr(attr) or nil})
-end -- }}}
-local function endtag (p, name) -- {{{
-    if singleton[name] then return end
-    local stack = p:getcallbacks().stack
-    if #stack > 1 then -- {o}
-        local element = tremove(stack)
-        tinsert(stack[#stack], element)
-    end
-end -- }}}
-local function cleantext (p, txt) -- {{{
-    txt = strgsub(txt, '&nbsp;', '')
-    if strfind(txt, '%S') then
-        txt = strmatch(txt, '^.*%S')
-        local stack = p:getcallbacks().stack
-        tinsert(stack[#stack], txt)
-    end
-end -- }}}
-local function text (p, txt) -- {{{
-    local stack = p:getcallbacks().stack
-    tinsert(stack[#stack], txt)
-end -- }}}
-local function comment (p, txt) -- {{{
-    local stack = p:getcallbacks().stack
-    tinsert(stack[#stack], '\0'..txt)
-end -- }}}
-local function extension (p, name, txt) -- {{{
-    local stack = p:getcallbacks().stack
-    tinsert(stack[#stack], '\0'..name..'\0'..txt)
-end -- }}}
-local function closing (p) -- {{{
-    local stack = p:getcallbacks().stack
-    while #stack > 1 do -- closing unmatched tags
-        local element = tremove(stack)
-        tinsert(stack[#stack], element)
-    end
+    cb.mode = mode
+    cb.batch = 256 -- events per Events call
+    cb.pairs = true -- attr {key = value}
+    cb.ext = '<?php ?> <%= %>' -- weird stuff
+    return cb
 end -- }}}
 
+local xgens = setmetatable({}, {__mode = 'k'}) -- [doc] = tree changes made through lom: stale tag indices
+local owner = setmetatable({}, {__mode = 'k'}) -- [selection] = the doc or selection it was taken from
+
+local function xgen (o) -- generation of the doc o was selected from
+    while owner[o] do o = owner[o] end
+    return xgens[o] or 0
+end
+
+local function touch (o) -- o or its nodes changed: indices of its doc and selections are stale
+    while owner[o] do o = owner[o] end
+    xgens[o] = (xgens[o] or 0) + 1
+end
+
 local function parse (o, txt) -- friend function {{{
     local p = o[0]
+    touch(o)
     -- local status, msg, line, col, pos = p:parse(txt) -- pass nil if failed
     local status, msg, line = p:parse(txt) -- pass nil if failed
     if not (txt and status) then
@@ -118,12 +117,35 @@ local function parse (o, txt) -- friend function {{{
     return o -- for cascade oop
 end --}}}
 -- ================================================================== --
-local function xPath (c, paths, doc, conti) -- {{{ return doc/xml-node table, ending index
+local CONTI = 0 -- scratch slots: CONTI, then hit/nth/merged/idx of odd and of even steps
+local function scratch (paths, level, k) -- {{{ emptied table k of the plan, per conti recursion level
+    paths.scratch = paths.scratch or {}
+    local s = paths.scratch[level]
+    if not s then s = {} ; paths.scratch[level] = s end
+    local t = s[k]
+    if not t then t = {} ; s[k] = t ; return t end
+    for i = #t, 1, -1 do t[i] = nil end
+    t['.'], t['@'] = nil, nil
+    return t
+end -- }}}
+
+local function xPath (c, paths, doc, conti, invidual, remove, level) -- {{{ return doc/xml-node table, ending index
     -- print('=>', c, '('..(paths[2 * c - 1] or '')..')', we.var2str(doc), we.var2str(conti))
+    level = level or 1
     local path = paths[2 * c - 1]
     if (not path) or path == '/' or path == '' or #doc == 0 then
+        local s = paths.scratch and paths.scratch[level]
+        if s then
+            for k, t in pairs(s) do
+                if doc == t and k ~= CONTI then -- the plan's own: a copy to the caller
+                    doc = {['.'] = t['.'], ['@'] = t['@']}
+                    for i = 1, #t do doc[i] = t[i] end
+                    break
+                end
+            end
+        end
         if conti and #conti > 0 then
-            local mt = xPath(1, paths, conti)
+            local mt = xPath(1, paths, conti, nil, invidual, remove, level + 1)
             for _, v in ipairs(mt) do tinsert(doc, v) end
             doc['.'], doc['@'] = doc['.'] or mt['.'], doc['@'] or mt['@']
         end
@@ -132,36 +154,38 @@ local function xPath (c, paths, doc, conti) -- {{{ return doc/xml-node table, en
     -- xpath syntax: NB: xpointer does not have standard treatment
     -- /A/B[@attr="val",@bb='4']
     -- anywhere/A/B[-3]/-2/3
-    local tag = (strsub(path, 1, 1) ~= '/') and path or strsub(path, 2, #path)
+    local tag = paths.tag[c] -- compiled
     path = paths[2 * c]
-
-    local idx = tonumber(tag)
-    if idx then return xPath(c + 1, paths, {doc[(idx - 1) % #doc + 1]}, conti) end
-
-    local autopass = true
-    if path then
-        for k, v in pairs(path) do
-            if not autopass then break end
-            if k ~= 0 then autopass = (type(k) == 'number') and (type(v) == 'number') end
-        end
+    local final = (2 * c) == #paths -- the result is the caller's, the steps before it are scratch
+    local slot = 4 * (c % 2) -- step c reads the tables of step c - 1
+
+    local idx = paths.idx[c]
+    if idx then
+        local v = doc[(idx - 1) % #doc + 1]
+        local t = final and {} or scratch(paths, level, slot + 4)
+        t[1] = v
+        return xPath(c + 1, paths, t, conti, invidual, remove, level)
     end
 
-    local xn = {} -- xml-node (doc)
-    local docl = (not paths.invidual) and doc['&'] -- follow xpointer or not
+    local autopass = paths.autopass[c]
+    local anywhere = paths.anywhere
+
+    local xn = final and {} or scratch(paths, level, slot + 1) -- xml-node (doc)
+    local docl = (not invidual) and doc['&'] -- follow xpointer or not
     local docn = 0
     repeat
         for i = 1, #doc do
             local mt = doc[i]
             if type(mt) == 'table' then
                 if mt['.'] == tag and (autopass or we.match(mt['@'], path)) then
-                    tinsert(xn, mt)
-                    if c == paths.remove then doc[i] = '\0'..'nil' end -- set as a comment
-                elseif strsub(paths[1], 1, 1) ~= '/' then -- start from anywhere?
-                    conti = conti or {} -- reset to 1 to continue
+                    xn[#xn + 1] = mt
+                    if c == remove then doc[i] = '\0'..'nil' end -- set as a comment
+                elseif anywhere then -- start from anywhere?
+                    conti = conti or scratch(paths, level, CONTI) -- reset to 1 to continue
                     if c == 1 then
-                        for _ = 1, #mt do tinsert(conti, mt[_]) end
+                        for _ = 1, #mt do conti[#conti + 1] = mt[_] end
                     else
-                        tinsert(conti, mt)
+                        conti[#conti + 1] = mt
                     end
                 end
             end
@@ -171,24 +195,25 @@ local function xPath (c, paths, doc, conti) -- {{{ return doc/xml-node table, en
     until not doc
 
     if path and #path > 0 and #xn > 0 then -- collect the indixed table
-        local nxn = {}
+        local nxn = final and {} or scratch(paths, level, slot + 2)
         for i = 1, #path do
             if type(path[i]) == 'number' then
-                tinsert(nxn, xn[(path[i] - 1) % #xn + 1])
+                nxn[#nxn + 1] = xn[(path[i] - 1) % #xn + 1]
             end
         end
         if #nxn ~= 0 then xn = nxn end -- collected
     end
     -- not final: break to further search
-    if #xn > 0 and (2 * c) ~= #paths and tag ~= '' then
-        local nxn = {['.'] = xn[1]['.'], ['@'] = xn[1]['@']}
+    if #xn > 0 and not final and tag ~= '' then
+        local nxn = scratch(paths, level, slot + 3)
+        nxn['.'], nxn['@'] = xn[1]['.'], xn[1]['@']
         for i = 1, #xn do
             local mt = xn[i]
-            for j = 1, #mt do tinsert(nxn, mt[j]) end
+            for j = 1, #mt do nxn[#nxn + 1] = mt[j] end
         end
         xn = nxn
     end
-    return xPath(c + 1, paths, xn, conti)
+    return xPath(c + 1, paths, xn, conti, invidual, remove, level)
 end -- }}}
 
 local function procXpath (path) -- {{{ XPath language parser
@@ -234,29 +259,243 @@ local function procXpath (path) -- {{{ XPath language parser
     -- print('path =', we.var2str(t)) -- debug
     return t
 end -- }}}
+
+local xcache, xcount = {}, 0 -- {{{ compiled xpath by path string, LRU
+local XCACHE = 128
+local xlru = {} -- ring of the plans: xlru.next the most recently used, xlru.prev the least
+xlru.next, xlru.prev = xlru, xlru
+
+local function xunlink (t) t.prev.next, t.next.prev = t.next, t.prev end
+local function xfront (t) t.prev, t.next = xlru, xlru.next ; xlru.next.prev = t ; xlru.next = t end
+
+local function compile (path) -- procXpath plus per step tag/idx/autopass; shared, read only but scratch
+    local t = xcache[path]
+    if t then xunlink(t) ; xfront(t) ; return t end
+
+    t = procXpath(path)
+    t.tag, t.idx, t.autopass = {}, {}, {}
+    t.anywhere = strsub(t[1], 1, 1) ~= '/'
+    t.steps = math.floor(#t / 2)
+    for c = 1, t.steps do
+        local tag = t[2 * c - 1]
+        tag = (strsub(tag, 1, 1) ~= '/') and tag or strsub(tag, 2, #tag)
+        t.tag[c], t.idx[c] = tag, tonumber(tag)
+        local autopass = true
+        for k, v in pairs(t[2 * c] or {}) do
+            if k ~= 0 and not (type(k) == 'number' and type(v) == 'number') then autopass = false ; break end
+        end
+        t.autopass[c] = autopass
+    end
+    t.indexed = t.steps == 1 and t.anywhere and not t.idx[1] and t.tag[1] ~= '' -- 'tag[attr=val]'
+    for _, v in pairs(t[2] or {}) do if type(v) == 'number' then t.indexed = false end end
+
+    if xcount == XCACHE then -- evict the least recently used
+        local old = xlru.prev
+        xunlink(old)
+        xcache[old.path] = nil
+        xcount = xcount - 1
+    end
+    t.path, t.scratch = path, {} -- scratch: tables of the steps before the last, reused
+    xcache[path] = t
+    xfront(t)
+    xcount = xcount + 1
+    return t
+end
+
+local function query (path) return type(path) == 'table' and path or compile(path) end
+-- }}}
+
+local xindex = setmetatable({}, {__mode = 'k'}) -- {{{ doc:index() tag index
+local function reindex (o) -- tag -> nodes by depth then document order, node -> parent
+    local idx = {gen = xgen(o), tags = {}, up = {}}
+    local level = {o}
+    while #level > 0 do
+        local nxt = {}
+        for _, p in ipairs(level) do
+            for i = 1, #p do
+                local n = p[i]
+                if type(n) == 'table' then
+                    local tag = n['.']
+                    if tag then
+                        idx.tags[tag] = idx.tags[tag] or {}
+                        tinsert(idx.tags[tag], n)
+                    end
+                    idx.up[n] = p
+                    tinsert(nxt, n)
+                end
+            end
+        end
+        level = nxt
+    end
+    xindex[o] = idx
+    return idx
+end
+
+local function xFind (o, paths) -- same as xPath(1, paths, o) for an indexed 'tag[attr]'
+    local idx = xindex[o]
+    if idx.gen ~= xgen(o) then idx = reindex(o) end
+    local path, autopass = paths[2], paths.autopass[1]
+    local xn, hit = {}, {} -- matches inside a match are not searched
+    for _, n in ipairs(idx.tags[paths.tag[1]] or {}) do
+        if autopass or we.match(n['@'], path) then
+            local p = idx.up[n]
+            while p ~= o and not hit[p] do p = idx.up[p] end
+            if p == o then tinsert(xn, n) end
+            hit[n] = true
+        end
+    end
+    return xn
+end
+
+local function aFind (a, paths) -- xFind over the arena of a lazy doc: only the candidates made
+    local ns, up = a:find(paths.tag[1])
+    local path, autopass = paths[2], paths.autopass[1]
+    local xn, hit = {}, {}
+    for i, n in ipairs(ns) do
+        if autopass or we.match(n['@'], path) then
+            local u = up[i]
+            while u and not hit[u] do u = up[u] end
+            if not u then tinsert(xn, n) end
+            hit[i] = true
+        end
+    end
+    return xn
+end
+
+local function xRun (paths, doc, invidual) -- indexed or walked
+    local lz = lazies[doc]
+    if paths.indexed and lz and lz[2] == xgen(doc) and (invidual or not doc['&']) then
+        return aFind(lz[1], paths)
+    end
+    if paths.indexed and xindex[doc] and #doc > 0 and (invidual or not doc['&']) then
+        return xFind(doc, paths)
+    end
+    return (xPath(1, paths, doc, nil, invidual))
+end
+-- }}}
+
+local function stream (paths, fn, mode) -- {{{ p = lom.stream(paths, fn(node, path), mode); p:parse(txt)..
+    -- '/A/B[attr=val,2]' matches from the root, 'A/B' at any depth; [n] counts matching siblings
+    mode = tonumber(mode) or 0x0f
+    local plans = {}
+    for _, path in ipairs(type(paths) == 'table' and paths or {paths}) do
+        local t = compile(path)
+        local plan = {path = path, anywhere = t.anywhere, tag = t.tag, attr = {}, nth = {}}
+        plan.steps = t.tag[t.steps] == '' and t.steps - 1 or t.steps -- 'A/B/'
+        for c = 1, plan.steps do
+            if t.idx[c] or t.tag[c] == '' then error('lom.stream: step '..c..' of '..path, 2) end
+            local attr, nth = {}, false
+            for k, v in pairs(t[2 * c] or {}) do
+                if type(v) ~= 'number' then attr[k] = v
+                elseif v > 0 then nth = nth or {} ; nth[v] = true
+                else error('lom.stream: negative index in '..path, 2) end
+            end
+            plan.attr[c], plan.nth[c] = next(attr) and attr, nth
+        end
+        tinsert(plans, plan)
+    end
+
+    -- open elements: {k = {[plan] = {steps matched}}, n = {[plan] = {step = children matched}}}
+    local stack = {{k = {}, n = {}}}
+    for _, plan in ipairs(plans) do stack[1].k[plan] = {0} end
+    local node, depth -- subtree being materialized, and its depth in stack
+
+    local function open (name, attr) -- frame for a new element; frame.hit = path it completes
+        local up, frame = stack[#stack], {k = {}, n = {}}
+        for _, plan in ipairs(plans) do
+            local ks, n = up.k[plan], up.n[plan] or {}
+            up.n[plan] = n
+            for _, k in ipairs(ks) do
+                local c = k + 1
+                if plan.tag[c] == name and (not plan.attr[c] or we.match(attr, plan.attr[c])) then
+                    n[c] = (n[c] or 0) + 1
+                    if not plan.nth[c] or plan.nth[c][n[c]] then
+                        if c == plan.steps then frame.hit = frame.hit or plan.path end
+                        if c < plan.steps then frame.k[plan] = frame.k[plan] or {} ; tinsert(frame.k[plan], c) end
+                    end
+                end
+            end
+            if plan.anywhere then frame.k[plan] = frame.k[plan] or {} ; tinsert(frame.k[plan], 0) end
+            frame.k[plan] = frame.k[plan] or {}
+        end
+        return frame
+    end
+
+    local cb = {}
+    cb.StartElement = function (p, name, attr) -- {{{
+        local e = {['.'] = name, ['@'] = attr}
+        if node then -- inside a match: only build
+            if singleton[name] then tinsert(node[#node], e) else tinsert(node, e) ; tinsert(stack, false) end
+            return
+        end
+        local frame = open(name, e['@'])
+        if singleton[name] then
+            if frame.hit then fn(e, frame.hit) end
+            return
+        end
+        if frame.hit then node, depth = {e}, #stack + 1 end
+        tinsert(stack, frame)
+    end -- }}}
+    cb.EndElement = function (p, name) -- {{{
+        if singleton[name] or #stack < 2 then return end
+        local frame = tremove(stack)
+        if not node then return end
+        if #stack < depth then -- match complete
+            local e = node[1]
+            node, depth = nil, nil
+            return fn(e, frame.hit)
+        end
+        tinsert(node[#node - 1], tremove(node))
+    end -- }}}
+    cb.CharacterData = (mode & 0x08 > 0) and function (p, txt) -- {{{
+        if not node then return end
+        txt = strgsub(txt, '&nbsp;', '')
+        if strfind(txt, '%S') then tinsert(node[#node], untext(strmatch(txt, '^.*%S'))) end
+    end or function (p, txt)
+        if node then tinsert(node[#node], untext(txt)) end
+    end -- }}}
+    cb.Comment = (mode & 0x20 > 0) and function (p, txt) -- {{{
+        if node then tinsert(node[#node], '\0'..txt) end
+    end or nil -- }}}
+    cb.Closing = function (p) -- {{{ unmatched tags
+        while #stack > 1 do cb.EndElement(p, '') end
+    end -- }}}
+    cb.Events = function (p, ev, n) -- {{{
+        for i = 1, 3 * n, 3 do
+            local f = cb[ev[i]]
+            if f then f(p, ev[i + 1], ev[i + 2]) end
+        end
+    end -- }}}
+
+    cb.mode, cb.batch, cb.pairs = mode, 256, true
+    cb.ext = '<?php ?> <%= %>'
+    return mp.new(cb)
+end -- }}}
 -- ================================================================== --
 local function xmlstr (s, fenc) -- {{{ enc: gzip -c | base64 -w 128 / dec: base64 -i -d | zcat -f
     s = tostring(s)
     if strfind(s, '\n') or (strlen(s) > 1024) then -- large text
-        if fenc or strfind(s, ']]>') then -- enc flag or hostile strings
-            -- local status, stdout, stderr = we.popen(s, 'gzip -c | base64 -w 128')
-            local status, stdout = we.popen(s, 'gzip -c | base64 -w 128')
-            return status and '<!-- base64 -i -d | zcat -f -->{{{'..stdout..'}}}' or ''
+        if fenc or strfind(s, ']]>') then -- enc flag or hostile strings: lsmp.encode, read back by untext
+            return '<!-- base64 -i -d | zcat -f -->{{{'..mp.encode(s)..'}}}'
         else
             return (strfind(s, '&') or strfind(s, '<') or strfind(s, '>'))
                 and '<![CDATA[\n'..s..']]>' or s
         end
-    else -- escape characters
+    elseif strfind(s, '[&"\'<>]') then -- escape characters
         return strgsub(strgsub(strgsub(strgsub(strgsub(s,
             '&', '&amp;'), '"', '&quot;'), "'", '&apos;'), '<', '&lt;'), '>', '&gt;')
     end
+    return s
 end -- }}}
 
-local function wXml (node) -- {{{
-    if 'string' == type(node) then
-        -- TODO extension <?php ?> <%= %> etc
-        return strsub(node, 1, 1) ~= '\0' and node or '<!--'..node..'-->'
-    end
+local indent = setmetatable({[0] = ''}, {__index = function (t, d) t[d] = t[d - 1]..'  ' ; return t[d] end})
+
+local function put (w, d, s) -- {{{ s with its lines indented to depth d
+    if d > 0 and strfind(s, '\n', 1, true) then s = strgsub(s, '\n', '\n'..indent[d]) end
+    w(s)
+end -- }}}
+
+local function wTag (node) -- {{{ '<tag attr="val" ...'
     local res = {}
     if node['@'] then
         for k, v in pairs(node['@']) do
@@ -264,16 +503,45 @@ local function wXml (node) -- {{{
             and '="'..strgsub(v, '"', '\\"')..'"' or ''))
         end
     end
-    res = '<'..node['.']..(#res > 0 and ' '..tconcat(res, ' ') or '')
+    return '<'..node['.']..(#res > 0 and ' '..tconcat(res, ' ') or '')
+end -- }}}
+
+local function wLine (node, room) -- {{{ node on one line if shorter than room; or nil, its tag
+    local res = wTag(node)
+    if #res >= room then return nil, res end
     if #node == 0 then return res..' />' end
-    res = {res..'>'}
-    for i = 1, #node do
-        tinsert(res, type(node[i]) == 'table' and wXml(node[i]) or xmlstr(node[i]))
-    end
-    if #res == 2 and #(res[2]) < 100 and not strfind(res[2], '\n') then
-        return res[1]..res[2]..'</'..node['.']..'>'
+    if #node > 1 then return nil, res end
+    local s = node[1] -- a short child is kept inline
+    room = mmin(100, room - #res - #node['.'] - 3)
+    if type(s) == 'table' then s = wLine(view(s), room) else s = strlen(s) < room and xmlstr(s) end
+    if s and #s < room and not strfind(s, '\n') then return res..'>'..s..'</'..node['.']..'>' end
+    return nil, res
+end -- }}}
+
+local function wXml (w, node) -- {{{ node written by w(s) in one pass, 2 spaces per level
+    if 'string' == type(node) then
+        -- TODO extension <?php ?> <%= %> etc
+        return w(strsub(node, 1, 1) ~= '\0' and node or '<!--'..node..'-->')
     end
-    return strgsub(tconcat(res, '\n'), '\n', '\n  ')..'\n</'..node['.']..'>' -- indent 2
+    local stack = {} -- {element, child index} of the open elements; depth = #stack
+    repeat
+        local s, tag
+        if type(node) == 'table' then node = view(node) ; s, tag = wLine(node, math.huge) else s = xmlstr(node) end
+        if s then
+            put(w, #stack, s)
+        else -- children on their own lines
+            tinsert(stack, {node, 0})
+            put(w, #stack, tag..'>') -- indented with the children
+        end
+        node = nil
+        while #stack > 0 and not node do
+            local top = stack[#stack]
+            top[2] = top[2] + 1
+            node = top[1][top[2]]
+            if not node then tremove(stack) end
+            w('\n'..indent[#stack]..(node and '' or '</'..top[1]['.']..'>'))
+        end
+    until not node
 end -- }}}
 
 local function dom2tbl (t, f) -- to a simple table: f is a map or detect {{{
@@ -305,6 +573,22 @@ local function dom2tbl (t, f) -- to a simple table: f is a map or detect {{{
     return leaf and tconcat(val, '\n') or val, t['.']
 end -- }}}
 
+local function clear (o) -- {{{ content and errors gone, for parsing again
+    for j = #o, 1, -1 do o[j] = nil end
+    o['?'], o['+'] = nil, nil
+end -- }}}
+
+local function restore (f, o, mode) -- {{{ o from snapshot f..'.lom' if made of f as it is now
+    local mtime, size = mp.stat(f)
+    mode = tonumber(mode) or 0x0f
+    if mode & 0x100 > 0 then return end -- lazy: parsed, not restored
+    if mtime and mp.restore(f..'.lom', o, mtime, size, mode) then
+        srcs[f] = {mtime, size, mode}
+        return o
+    end
+    clear(o) -- in case of a corrupt one
+end -- }}}
+
 local dom = class { -- lua document object model {{{
     ['.'] = false; -- tag name
     ['@'] = false; -- attr
@@ -315,6 +599,8 @@ local dom = class { -- lua document object model {{{
 
     ['<'] = function (o, spec, mode) --{{{
         mode = tonumber(mode) or 0x0f
+        -- 0x100 lazy: kept by lsmp, tables made when touched
+        -- 0x80 mp: line/column counted on demand
         -- 0x40 extension: <?php ?> <%= %>
         -- 0x20 keep comment
         -- 0x10 scheme
@@ -329,35 +615,17 @@ local dom = class { -- lua document object model {{{
             end
         elseif type(spec) == 'string' then -- '' for text
 
-            local p = mp.new {
-                Scheme = (mode & 0x10 > 0) and scheme or nil,
-                StartElement = starttag,
-                EndElement = endtag,
-                CharacterData = (mode & 0x08 > 0) and cleantext or text,
-                Comment = (mode & 0x20 > 0) and comment or nil,
-                Extension = (mode & 0x40 > 0) and extension or nil,
-                Closing = closing,
-                mode = mode,
-                ext = '<?php ?> <%= %>', -- weird stuff
-                stack = {o} -- {{}}
-            }
-
             if spec == '' then
-                o[0] = p
+                o[0] = mp.new(callbacks(o, mode))
                 o.parse = parse
-            else
-                local file, msg, status, line
-                file, msg = io.open(spec, 'r')
-                if file then -- clean up xml/html mess
-                    msg = file:read('*all')
-                    file:close()
-                    -- local status, msg, line, col, pos = p:parse(msg)
-                    status, msg, line = p:parse(msg)
-                    if status then status, msg, line = p:parse() end
-                    if not status then o['?'] = {msg..' #'..line} else p:close() end
-                else
-                    o['?'] = {msg}
-                end
+            elseif not restore(spec, o, mode) then -- snapshot of the file as it is
+                srcs[spec] = {mp.stat(spec)}
+                srcs[spec][3] = mode
+                -- local status, msg, line, col, pos = mp.domfile(spec, mode, singleton, o)
+                local lazy = mode & 0x100 > 0
+                local status, msg, line = (lazy and mp.lazyfile or mp.domfile)(spec, mode, singleton, o) -- file mapped
+                if not status then o['?'] = {msg..(line and ' #'..line or '')}
+                elseif lazy then lazies[o] = {msg, xgen(o)} end -- msg: the arena
             end
             if spec == '' then tinsert(docs, o) else docs[spec] = o end
         end
@@ -375,43 +643,179 @@ local dom = class { -- lua document object model {{{
 
     parse = false; -- implemented in friend function
 
-    xpath = function (o, path, doc)
-        return (xPath(1, procXpath(path), doc or o)) -- only first
+    xpath = function (o, path, doc) -- path string or lom.compile(path)
+        return xRun(query(path), doc or o) -- only first
+    end;
+
+    index = function (o) -- tag index for 'tag[attr]' queries on o, rebuilt after lom changes
+        reindex(o)
+        return o
     end;
 
     -- output
-    drop = function (o, fxml) -- {{{ drop fxml=1/html
+    drop = function (o, fxml, out) -- {{{ drop fxml=1/html; written to out (file or function) if given
         if not fxml then return we.var2str(o) end
-        local res = {fxml == 1 and '<?xml version="1.0" encoding="UTF-8"?>' or nil}
-        local docl = o['&']
-        local docn = 0
+        local res, sep = {}, ''
+        local w = io.type(out) == 'file' and function (s) out:write(s) end
+            or out or function (s) res[#res + 1] = s end
+        if fxml == 1 then w('<?xml version="1.0" encoding="UTF-8"?>') ; sep = '\n' end
+        local docl, docn, doc = o['&'], 0, o
         repeat
-            for j = 1, #o do tinsert(res, wXml(o[j])) end
+            for j = 1, #doc do w(sep) ; wXml(w, doc[j]) ; sep = '\n' end
             docn = docn + 1
-            o = docl and docl[docn]
-        until not o
-        return tconcat(res, '\n')
+            doc = docl and docl[docn]
+        until not doc
+        if out then return o end
+        return tconcat(res)
     end;-- }}}
 
+    save = function (o, path) -- binary snapshot; path of a doc file f: f..'.lom', used by lom(f) till f changes
+        local f
+        for k, v in pairs(docs) do if v == o and type(k) == 'string' then f = k end end
+        local s = srcs[f] or {}
+        path = path or f and f..'.lom' or error('doc:save: no path', 2)
+        local status, msg = mp.save(o, path, s[1], s[2], tonumber(s[3]) or 0x0f)
+        if not status then return nil, msg end
+        return o
+    end;
+
     -- member functions supporting cascade oo style
     select = function (o, path)
-        path = procXpath(path)
-        path.invidual = true
-        return class:new(o, (xPath(1, path, o)))
+        local sel = class:new(o, xRun(query(path), o, true))
+        owner[sel] = o
+        return sel
     end;
 
     remove = function (o, path)
-        path = procXpath(path)
-        path.invidual = true
-        -- path.remove = #path >> 1
-        path.remove = math.floor(#path / 2)
-        return o, xPath(1, path, o) -- if the removed is needed
+        path = query(path)
+        touch(o)
+        return o, xPath(1, path, o, nil, true, path.steps) -- if the removed is needed
     end;
 } -- }}}
 -- }}}
 
+local function parsefiles (files, roots, mode) -- {{{ on threads by lsmp.load, into roots
+    for _, f in ipairs(files) do
+        srcs[f] = {mp.stat(f)}
+        srcs[f][3] = mode
+    end
+    local _, errs
+    if (tonumber(mode) or 0) & 0x100 > 0 then -- lazy: each kept by lsmp
+        errs = {}
+        for i, f in ipairs(files) do
+            local status, msg, line = mp.lazyfile(f, mode, singleton, roots[i])
+            if status then lazies[roots[i]] = {msg, xgen(roots[i])} else errs[i] = {msg, line} end
+        end
+    else
+        _, errs = mp.load(files, tonumber(mode) or 0x0f, singleton, roots)
+    end
+    for i, f in ipairs(files) do
+        if errs[i] then roots[i]['?'] = {errs[i][1]..(errs[i][2] and ' #'..errs[i][2] or '')} end
+        docs[f] = roots[i]
+    end
+end -- }}}
+
+local function load (files, mode) -- {{{ docs of files, the new ones parsed together
+    local todo, roots = {}, {}
+    for _, f in ipairs(files) do
+        f = we.normpath(f)
+        if not (docs[f] or todo[f]) then
+            local o = dom({}, mode)
+            if restore(f, o, mode) then
+                docs[f] = o
+            else
+                todo[f] = true
+                tinsert(todo, f)
+                tinsert(roots, o)
+            end
+        end
+    end
+    if #todo > 0 then parsefiles(todo, roots, mode) end
+    local res = {}
+    for i, f in ipairs(files) do res[i] = docs[we.normpath(f)] end
+    return res
+end -- }}}
+
+local function reload () -- {{{ files changed since parsed: parsed again into the same docs
+    local todo = {} -- [mode] = {files}
+    for f, s in pairs(srcs) do
+        local mtime, size = mp.stat(f)
+        if docs[f] and (mtime ~= s[1] or size ~= s[2]) then
+            local mode = s[3] or 0x0f
+            todo[mode] = todo[mode] or {}
+            tinsert(todo[mode], f)
+        end
+    end
+    local changed = {}
+    for mode, files in pairs(todo) do
+        local roots = {}
+        for i, f in ipairs(files) do
+            local o = docs[f]
+            clear(o)
+            touch(o)
+            roots[i] = o
+            changed[f] = true
+        end
+        parsefiles(files, roots, mode)
+    end
+    return changed
+end -- }}}
+
+local function linkfile (href, xml) -- {{{ file of xlink:href in doc xml, and the #xpointer part
+    local link, xpath = strmatch(href, '^([^#]*)(.*)') -- file_link, tag_path
+    if link == '' then -- back to this doc root
+        link = xml
+    else -- new file
+        if strsub(link, 1, 1) ~= '/' then
+            link = strgsub(type(xml) == 'string' and xml or '', '[^/]*$', '')..link
+        end
+        link = we.normpath(link)
+    end
+    return link, xpath
+end -- }}}
+
+local function preload (todo) -- {{{ files linked from docs todo, loaded together level by level
+    repeat
+        local files, seen = {}, {}
+        local function scan (doc, xml)
+            local href = doc['@'] and doc['@']['xlink:href']
+            if href then
+                local link = linkfile(href, xml)
+                if type(link) == 'string' and not (docs[link] or seen[link]) then
+                    seen[link] = true
+                    tinsert(files, link)
+                end
+            end
+            for i = 1, #doc do
+                if type(doc[i]) == 'table' and doc[i]['.'] then scan(doc[i], xml) end
+            end
+        end
+        for xml, o in pairs(todo) do if not o['?'] then scan(o, xml) end end
+        todo = {}
+        for i, o in ipairs(load(files)) do todo[files[i]] = o end
+    until #files == 0
+end -- }}}
+
 local buildxlink = function () -- xlink -- xlink/xpointer based on root {{{
     for _, xml in ipairs(docs) do if xml.parse then xml:parse() end end
+    local dirty = reload() -- docs whose links are resolved again
+    for xml in pairs(docs) do if not links[xml] then dirty[xml] = true end end
+    local todo = {}
+    for xml in pairs(dirty) do todo[xml] = docs[xml] end
+    preload(todo)
+    for xml in pairs(docs) do if not links[xml] then dirty[xml] = true end end
+    todo = {} -- and the docs linking to them
+    for xml in pairs(dirty) do tinsert(todo, xml) end
+    while #todo > 0 do
+        for xml in pairs(links[0][tremove(todo)] or {}) do
+            if not dirty[xml] then dirty[xml] = true ; tinsert(todo, xml) end
+        end
+    end
+    for xml in pairs(dirty) do -- edges found again
+        for link in pairs(links[xml] or {}) do links[0][link][xml] = nil end
+        links[xml] = {}
+    end
+
     local stamp = math.random()
     local stack = {}
     local function traceTbl (doc, xml) -- {{{ lua table form
@@ -427,19 +831,14 @@ local buildxlink = function () -- xlink -- xlink/xpointer based on root {{{
             stack[href] = true
 
             if (not doc['&']) or (doc['&'][0] ~= stamp) then -- attr
-                local link, xpath = strmatch(href, '^([^#]*)(.*)') -- {{{ file_link, tag_path
-                if link == '' then -- back to this doc root
-                    link = xml
-                else -- new file
-                    if strsub(link, 1, 1) ~= '/' then
-                        link = strgsub(type(xml) == 'string' and xml or '', '[^/]*$', '')..link
-                    end
-                    link = we.normpath(link)
-                end -- }}}
+                local link, xpath = linkfile(href, xml)
 
                 if (type(link) == 'string') and not docs[link] then docs[link] = dom(link) end
-                if xml ~= link then traceTbl(docs[link], link) end
-                local paths = procXpath(strmatch(xpath or '', '#xpointer%((.*)%)'))
+                if xml ~= link and dirty[link] then traceTbl(docs[link], link) end
+                links[xml][link] = true
+                links[0][link] = links[0][link] or {}
+                links[0][link][xml] = true
+                local paths = compile(strmatch(xpath or '', '#xpointer%((.*)%)'))
                 link, xpath = xPath(1, paths, docs[link])
 
                 if #link == 0 then -- error message
@@ -461,7 +860,7 @@ local buildxlink = function () -- xlink -- xlink/xpointer based on root {{{
             if type(doc[i]) == 'table' and doc[i]['.'] then traceTbl(doc[i], xml) end
         end
     end -- }}}
-    for xml, o in pairs(docs) do if not o['?'] then traceTbl(o, xml) end end
+    for xml, o in pairs(docs) do if dirty[xml] and not o['?'] then traceTbl(o, xml) end end
 end; -- }}}
 
 local lom = setmetatable({}, {
@@ -478,6 +877,15 @@ local lom = setmetatable({}, {
     end; -- }}}
     __index = {
         doc = docs;
+        compile = compile; -- cached query plan for select/xpath/remove
+        load = load; -- files parsed in parallel: lom.load{f1, f2, ...} --> {doc1, doc2, ...}
+        stream = stream; -- select while parsing, without the dom
+        restore = function (path) -- doc from a snapshot of doc:save(path)
+            local o = dom({})
+            local status, msg = mp.restore(path, o)
+            if not status then o['?'] = {msg} end
+            return o
+        end;
         singleton = function (str)
             for k in pairs(singleton) do singleton[k] = nil end -- reset
             for k in strgmatch(str, '%S+') do singleton[k] = true end
@@ -525,6 +933,7 @@ lom.api.map = function (o, func) -- map data and process nodes {{{
 end -- }}}
 
 lom.api.text = function (o, txt) -- {{{
+    touch(o)
     for i = 1, #o do
         if type(o[i]) == 'table' then tinsert(o[i], txt) end
     end
@@ -532,6 +941,7 @@ lom.api.text = function (o, txt) -- {{{
 end -- }}}
 
 lom.api.arrange = function (o, ele, i) -- {{{ also remove/append TODO
+    touch(o)
     if type(o[1]) == 'table' then
         tinsert(o[1], ((tonumber(i) or 0) -1) % (#(o[1]) + 1) + 1, {['.'] = ele})
     end
@@ -7,53 +7,47 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "lsmp.h"
 
+#if !defined(SML_NOSIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define SML_VEC     32
+#define SML_VLOAD(x)        _mm256_loadu_si256((const __m256i *) (x))
+#define SML_VMASK(v, ch)    ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch))))
+typedef __m256i SML_vec;
+#elif !defined(SML_NOSIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SML_VEC     16
+#define SML_VLOAD(x)        _mm_loadu_si128((const __m128i *) (x))
+#define SML_VMASK(v, ch)    ((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(ch))))
+typedef __m128i SML_vec;
+#endif
+
 #ifdef DEBUG
 #define DBG(l,x);  if (DEBUG >= l) {x}
 #else
 #define DBG(l,x);
 #endif
 
+typedef struct SML_Qev { BYTE type, tok; unsigned int name, lname, data, ldata, attr, nattr; } SML_Qev;
+
+struct SML_Pull { /* events of the last scan, with copies of their strings */
+  SML_Qev *q;
+  unsigned int nq, iq, mq;   /* queued, the next out, allocated */
+  char *s;
+  unsigned int ns, ms;
+  SML_Tok *a;                /* attribute strings; len -1: NULL (a bare key in pairs) */
+  unsigned int na, ma;
+  SML_Str *out;              /* attributes of the event out */
+  unsigned int mout;
+};
+
 const char *SML_ErrorString[] = {
   "OK", /* OK */
 };
 
-/* general link {{{ */
-static Glnk *stackGlnk = NULL;
-static Glnk *GlnkTop = NULL;
-
-#define GLNKINCRSIZE    16
-
-static void stGlnkGrow () {
-  Glnk *p = (Glnk *) malloc(sizeof(Glnk) * GLNKINCRSIZE);
-  p->next = stackGlnk; stackGlnk = p;
-  (++p)->next = GlnkTop;
-  int c = GLNKINCRSIZE - 1;
-  while (--c) { p++; p->next = p - 1; }
-  GlnkTop = p;
-}
-
-static Glnk *stGlnkPop () {
-  if (!GlnkTop) stGlnkGrow();
-  Glnk *p = GlnkTop; GlnkTop = GlnkTop->next;
-  return p;
-}
-
-static void stGlnkPush (Glnk *p) {
-  p->next = GlnkTop; GlnkTop = p;
-}
-
-static void stGlnkFree () {
-  while (stackGlnk) {
-    Glnk *p = stackGlnk;
-    stackGlnk = stackGlnk->next;
-    free(p);
-  }
-}
-/* }}} */
-
 /* process instruction p = lsmp.new(callbacks) {{{
 assert(p:parse[[<to><?lua how is this passed to <here>? ?></to>]])
 new --> parser
@@ -65,133 +59,559 @@ new --> parser
   Extension = extension,
   mode = flags,
   ext = '<?php ?> <%= %>',
+  chunk = 65536, -- typical p:parse(s) size, the first buffer allocation
+  pairs = true, -- StartElement attr as {key = 'value' or true}, unquoted; nil without attributes
+  batch = 256, Events = events, -- events(p, ev, n): ev[3i-2..3i] = key, arg1, arg2
+  skip = 'script style svg', -- dropped with their content, no events
   stack = {o} -- {{}}
+p:parse(s) ... p:parse() --> streaming, the last call closes the document
+p:parseall(s) --> whole document, parsed in place without copying s
+p:rebind([cbt]) --> callbacks are looked up once, at new and rebind
+StartElement returning true (without batch) skips the content up to its end tag
+lsmp.dom(s, mode, singleton, root, skip, threads) --> lom table tree of s built in C
+lsmp.encode(s), lsmp.decode(s) --> large text as gzip in base64, and back
+lsmp.load(files, mode, singleton, roots, threads) --> roots, errors: files parsed on threads
+lsmp.stat(path) --> mtime, size
 */
 
+#define SML_sep(ch)  ((ch) <= ' ' || (ch) > '~')
+
+static void SML_exts (SML_Parser p, const char *ext) { /* '<?php ?> <%= %>': pairs, openers in a trie */
+  p->szExts = NULL;
+  p->lszExts = NULL;
+  p->trie = NULL;
+  p->Exts = 0;
+  while (ext && *ext && SML_sep(*ext)) ext++;
+  if (!ext || !*ext) return;
+  size_t l = strlen(ext);
+  char *t = (char *) memcpy(malloc(l + 1), ext, l + 1), *s;
+  int c = 0, i;
+  for (s = t; *s; s++) if (!SML_sep(*s) && (s == t || SML_sep(s[-1]))) c++;
+  if ((c >>= 1) > 255) c = 255;
+  const char **psz = p->szExts = (const char **) malloc(sizeof(char *) * (2 * c + 1));
+  for (s = t, i = 0; i < 2 * c; i++) { /* NUL-terminated in t, t first */
+    psz[i] = s;
+    while (*s && !SML_sep(*s)) s++;
+    if (*s) *s++ = '\0';
+    while (*s && SML_sep(*s)) s++;
+  }
+  p->Exts = (BYTE) c;
+  p->lszExts = (char *) malloc((size_t) c + 1);
+  SML_Ext *x = p->trie = (SML_Ext *) calloc(l + 1, sizeof(SML_Ext));
+  WORD m = 1;
+  for (i = 0; i < c; i++) {
+    const char *o = psz[2 * i];
+    WORD k = 0, j;
+    p->lszExts[i] = (char) strlen(psz[2 * i + 1]);
+    for (o += *o == '<'; *o; o++, k = j) {
+      for (j = x[k].child; j && x[j].ch != *o; j = x[j].next);
+      if (!j) {
+        x[j = m++].ch = *o;
+        x[j].next = x[k].child;
+        x[k].child = j;
+      }
+    }
+    if (k && !x[k].ext) x[k].ext = (BYTE) (i + 1); /* the first pair wins */
+  }
+  for (i = x[0].child; i; i = x[i].next) p->cc[(BYTE) x[i].ch] |= C_TAG; /* markup, even if sloppy */
+}
+
+static int SML_ext (SML_Parser p, const char *s, int n) { /* pair of the opener s[0..n), or -1 */
+  const SML_Ext *x = p->trie;
+  WORD k = 0, j;
+  if (!x) return -1;
+  for (; n--; s++, k = j) {
+    for (j = x[k].child; j && x[j].ch != *s; j = x[j].next);
+    if (!j) return -1;
+  }
+  return (int) x[k].ext - 1;
+}
+
 SML_Parser SML_ParserCreate (void *ud, int mode, const char *ext) {
   SML_Parser p = (SML_Parser) malloc(sizeof(struct SML_ParserStruct));
   if (!p) return p;
   p->ud = ud;
   p->buf = NULL;
-  p->len = p->size = p->r = p->c = p->i = p->n = 0;
+  p->off = p->len = p->size = p->r = p->c = p->i = p->n = 0;
+  p->hint = SML_CHUNK;
+  p->base = p->at = 0;
+  p->lazy = (mode & M_LAZY) != 0;
+  p->zc = 0;
+  p->pairs = 0;
   p->mode = (mode & M_MODES) | S_TEXT;
   p->quote = '\0';
 
-  int c = 0; /* prepare extension start/end token arrays */
-  if (ext) {
-    char *s = (char *) ext;
-    while (*s) {
-      if (*s <= ' ' || *s > '~') c++;
-      s++;
-    }
-    char **psz = (char **) malloc(sizeof(char *) * (++c));
-    p->szExts = (const char **) psz;
-    *psz++ = s = (char *) malloc((size_t) (s - ext) + 1);
-    while ((*s++ = *ext)) {
-      if (*ext <= ' ' || *ext > '~') *((*psz++ = s) - 1) = '\0';
-      ext++;
-    }
-    *(s - 1) = '\0';
-    p->Exts = (c >>= 1);
-    p->lszExts = (char *) malloc((size_t) c);
-    while (c--) p->lszExts[c] = (char) strlen(p->szExts[2 * c + 1]);
-  }
-  else {
-    p->szExts = NULL;
-    p->lszExts = NULL;
-    p->Exts = 0;
+  int i;
+  for (i = 0; i < 256; i++) { /* char as the scanner compares it */
+    char ch = (char) i;
+    BYTE k = (ch <= ' ' ? C_SPACE : 0) | (ch == 0x7F ? C_DEL : 0) | (ch == '"' || ch == '\'' ? C_QUOTE : 0) |
+      (ch == '<' ? C_LT : 0) | (ch == '>' ? C_GT : 0) |
+      (ch == '_' || (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') ? C_NAME : 0);
+    if (!(mode & M_SLOPPY) || !ch || (k & C_NAME) || ch == '!' || ch == '/' || ch == '?') k |= C_TAG;
+    p->cc[i] = k;
   }
+  SML_exts(p, ext);
 
-  p->elem = NULL;
+  p->elem.s = NULL;
+  p->elem.len = 0;
   p->attr = NULL;
+  p->nattr = p->mattr = 0;
+  p->arena = NULL;
   p->level = 0; /* < <* .. > > */
+  p->szSkips = NULL;
+  p->Skips = p->skipe = p->sreq = 0;
+  p->sname = NULL;
+  p->lsname = p->msname = p->skip = p->sm = 0;
+  p->rest = p->budget = 0;
+  p->pull = NULL;
+  p->fin = 0;
   return p;
 }
 
+void SML_SetSkip (SML_Parser p, const char *names) { /* 'script style svg': dropped with their content */
+  if (p->Skips) {
+    free((void *) p->szSkips[0].s);
+    free(p->szSkips);
+  }
+  p->szSkips = NULL;
+  p->Skips = 0;
+  while (names && *names && *names <= ' ') names++;
+  if (!names || !*names) return;
+  const char *s;
+  int c = 1;
+  for (s = names; *s; s++) if (*s <= ' ' && s[1] > ' ') c++;
+  char *t = (char *) memcpy(malloc((size_t) (s - names)), names, (size_t) (s - names));
+  const char *e = t + (s - names);
+  p->szSkips = (SML_Str *) malloc(sizeof(SML_Str) * c);
+  for (s = t; s != e && p->Skips < 255;) {
+    SML_Str *a = p->szSkips + p->Skips++;
+    for (a->s = s; s != e && *s > ' '; s++);
+    a->len = s - a->s;
+    while (s != e && *s <= ' ') s++;
+  }
+}
+
+/* arena: bump allocation for the tag being parsed {{{ */
+static void *SML_alloc (SML_Parser p, unsigned int n) {
+  SML_Blk *b = p->arena;
+  n = (n + 7) & ~7u; /* aligned for SML_Str */
+  if (!b || b->used + n > b->size) { /* chain a larger block */
+    unsigned int size = b ? b->size * 2 : SML_ARENA;
+    while (size < n) size *= 2;
+    SML_Blk *t = (SML_Blk *) malloc(sizeof(SML_Blk) + size);
+    t->next = b; t->size = size; t->used = 0;
+    p->arena = b = t;
+  }
+  void *m = b->data + b->used;
+  b->used += n;
+  return m;
+}
+
+static void SML_reset (SML_Parser p) { /* keep only the last (largest) block */
+  SML_Blk *b = p->arena;
+  if (!b) return;
+  while (b->next) {
+    SML_Blk *t = b->next; b->next = t->next;
+    free(t);
+  }
+  b->used = 0;
+} /* }}} */
+
+static void SML_elem (SML_Parser p, const char *s, int len) { /* copied unless zero-copy */
+  if (!p->zc) s = (const char *) memcpy(SML_alloc(p, len), s, len);
+  p->elem.s = s;
+  p->elem.len = len;
+}
+
+static void SML_drop (SML_Parser p) { /* tag delivered: release its name and attributes */
+  p->elem.s = NULL;
+  p->elem.len = 0;
+  SML_reset(p);
+}
+
 void SML_ParserFree (SML_Parser p) {
   free(p->buf);
-  if (p->Exts) {
-    free((void *)(*(p->szExts)));
-    free(p->szExts);
-    free(p->lszExts);
+  SML_drop(p);
+  free(p->arena);
+  free(p->attr);
+  free(p->sname);
+  SML_SetSkip(p, NULL);
+  if (p->Exts) free((void *)(*(p->szExts)));
+  free(p->szExts);
+  free(p->lszExts);
+  free(p->trie);
+  if (p->pull) {
+    free(p->pull->q);
+    free(p->pull->s);
+    free(p->pull->a);
+    free(p->pull->out);
+    free(p->pull);
   }
   free(p);
 }
 
-static const char **SML_attr (SML_Parser p) { /* n + 1(NULL) */
-  int c = 0;
-  const char **szAttr;
-  Glnk *attr = p->attr;
-  while (attr) { c++; attr = attr->next; }
-  szAttr = (const char **) malloc(sizeof(char *) * (c + 1));
-  szAttr[c--] = (const char *) NULL;
-  attr = p->attr;
-  while (attr) {
-    szAttr[c--] = (const char *) attr->data; /* key (+ value) */
-    Glnk *tmp = attr; attr = attr->next; stGlnkPush(tmp);
+static void SML_push (SML_Parser p, const char *s, int len) { /* collect an attribute token */
+  if (p->nattr == p->mattr)
+    p->attr = (SML_Tok *) realloc(p->attr, sizeof(SML_Tok) * (p->mattr = p->mattr ? p->mattr * 2 : 16));
+  SML_Tok *attr = p->attr + p->nattr++;
+  attr->off = s - p->buf; attr->len = len; /* survives moving buf */
+}
+
+static const SML_Str *SML_attr (SML_Parser p) { /* n + 1(NULL) */
+  unsigned int c = p->nattr;
+  SML_Str *szAttr = (SML_Str *) SML_alloc(p, sizeof(SML_Str) * (c + 1)); /* valid until SML_drop */
+  szAttr[c].s = NULL;
+  szAttr[c].len = 0;
+  while (c--) {
+    szAttr[c].s = p->buf + p->attr[c].off; /* key (+ value) */
+    szAttr[c].len = p->attr[c].len;
   }
-  p->attr = NULL;
+  p->nattr = 0;
   return szAttr;
-} /* }}} */
+}
 
-#define incr(x,p);  switch (*x++) { case '\n': p->n = p->c; p->r++; p->c = 0; default: p->c++; p->i++; }
+static SML_Str SML_trimq (const char *s, int len) { /* without matching quotes */
+  SML_Str t = {s, len};
+  if (len > 1 && (*s == '"' || *s == '\'') && s[len - 1] == *s) { t.s++; t.len -= 2; }
+  return t;
+}
 
-const char *mus = "<"; /* markup start */
-const char *mue = ">"; /* markup end */
+static BYTE SML_listed (SML_Parser p) { /* p->elem in the skip list */
+  int i;
+  for (i = 0; i < p->Skips; i++)
+    if (p->szSkips[i].len == p->elem.len && 0 == memcmp(p->szSkips[i].s, p->elem.s, p->elem.len)) return 1;
+  return 0;
+}
 
-/* heurestic smp (sloppy markup parser) {{{ */
-enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
-  if (len && (p->mode & S_STATES) == S_DONE) return MPSerror;
-  BYTE fEnd = (s == NULL);
+/* S_SKIP sub-states in p->sm */
+#define SK_TEXT     0
+#define SK_NAME     1 /* after < */
+#define SK_TAG      2 /* in another tag */
+#define SK_OPEN     3 /* in <name */
+#define SK_CLOSE    4 /* in </name */
+#define SK_COMMENT  5
+#define SK_CDATA    6
+#define SK_EXT      7
+
+static BYTE SML_skipto (SML_Parser p, BYTE emit) { /* fast-forward past the end tag of p->elem */
+  if (p->msname < (unsigned int) p->elem.len)
+    p->sname = (char *) realloc(p->sname, p->msname = p->elem.len);
+  memcpy(p->sname, p->elem.s, p->lsname = p->elem.len);
+  p->skip = 1;
+  p->sm = SK_TEXT;
+  p->quote = '\0';
+  p->level = 0;
+  p->skipe = emit;
+  return S_SKIP;
+}
 
-  if (len) { /* merge/add to p->buf */
-    if (p->size < p->len + len) p->buf = (char *) realloc(p->buf, p->size = p->len + len);
-    memcpy(p->buf + p->len, s, len);
+void SML_SkipElement (SML_Parser p) { /* from the start handler: no events until its end tag */
+  struct SML_Pull *q = p->pull;
+  if (!q) {
+    p->sreq = 1;
   }
-  else if (!fEnd) {
-    return MPSok;
+  else if (q->iq && q->iq == q->nq && q->q[q->iq - 1].type == SML_START && (p->mode & S_STATES) == S_TEXT) {
+    SML_Str elem = p->elem; /* pulled: the scan stopped right after the start tag */
+    p->elem.s = q->s + q->q[q->iq - 1].name;
+    p->elem.len = (int) q->q[q->iq - 1].lname;
+    p->mode = (p->mode & M_MODES) | SML_skipto(p, 1);
+    p->elem = elem;
   }
+}
 
-  /* adjust last parsed result */
-  if (((p->mode & S_STATES) == S_TEXT) && p->len && p->buf[p->len] == '<') {
-    p->len--;
-    len++;
-    if (p->c) { p->c--; } else { p->r--; p->c = p->n; } /* or col of last line */
-    p->i--;
+#define pair(a,n,x,y)  { a[n++] = x; a[n++] = y; }
+
+static const SML_Str *SML_pairs (SML_Parser p) { /* key, value, ..., NULL (len 1: had tokens); value.s NULL: bare key */
+  SML_Str *a = (SML_Str *) SML_alloc(p, sizeof(SML_Str) * (2 * p->nattr + 1));
+  SML_Str k = {NULL, 0}, none = {NULL, 0}, empty = {"", 0};
+  unsigned int i, n = 0;
+  BYTE v = 0; /* '=' seen after k */
+  for (i = 0; i < p->nattr; i++) { /* tokens: key key= =val key=val = "val" */
+    const char *s = p->buf + p->attr[i].off;
+    int len = p->attr[i].len;
+    const char *q = (const char *) memchr(s, '=', (size_t) len);
+    if (!q) { /* key, or value after = */
+      if (v) {
+        pair(a, n, k, SML_trimq(s, len));
+        k.s = NULL;
+      }
+      else {
+        if (k.s) pair(a, n, k, none);
+        k.s = s; k.len = len;
+      }
+      v = 0;
+    }
+    else if (len == 1) { /* = */
+      v = k.s != NULL;
+    }
+    else if (q == s) { /* =val */
+      if (k.s) {
+        pair(a, n, k, SML_trimq(s + 1, len - 1));
+        k.s = NULL;
+      }
+      else {
+        k = SML_trimq(s + 1, len - 1);
+      }
+      v = 0;
+    }
+    else {
+      if (k.s) pair(a, n, k, v ? empty : none);
+      k.s = s; k.len = q - s;
+      if ((v = (++q == s + len))) continue; /* key= */
+      pair(a, n, k, SML_trimq(q, s + len - q)); /* key=val */
+      k.s = NULL;
+    }
+  }
+  if (k.s) pair(a, n, k, v ? empty : none);
+  a[n].s = NULL;
+  a[n].len = p->nattr != 0; /* a lone = pairs nothing, yet the tag had attributes */
+  p->nattr = 0;
+  return a;
+} /* }}} */
+
+#define incr(x,p);  if (lazy) x++; else switch (*x++) { case '\n': p->n = p->c; p->r++; p->c = 0; default: p->c++; p->i++; }
+#define mark(x,p);  p->at = p->base + (x - p->buf);
+
+/* delimiter scanning {{{ */
+static char *SML_find (char *c, const char *e, char ch) { /* next ch in [c, e) or e */
+#ifdef SML_VEC
+  while (e - c >= SML_VEC) {
+    SML_vec v = SML_VLOAD(c);
+    unsigned int m = SML_VMASK(v, ch);
+    if (m) return c + __builtin_ctz(m);
+    c += SML_VEC;
+  }
+  while (c != e && *c != ch) c++;
+  return c;
+#else
+  c = (char *) memchr(c, ch, (size_t) (e - c));
+  return c ? c : (char *) e;
+#endif
+}
+
+static void SML_count (SML_Parser p, const char *c, const char *e) { /* incr over [c, e) in bulk */
+  const char *l = NULL, *k = NULL; /* last and 2nd last '\n' */
+  unsigned int r = 0;
+  p->i += e - c;
+#ifdef SML_VEC
+  const char *b = c;
+  while (e - b >= SML_VEC) {
+    unsigned int m = SML_VMASK(SML_VLOAD(b), '\n');
+    if (m) {
+      r += __builtin_popcount(m);
+      int h = 31 - __builtin_clz(m);
+      m &= ~(1u << h);
+      k = m ? b + 31 - __builtin_clz(m) : l;
+      l = b + h;
+    }
+    b += SML_VEC;
+  }
+  for (; b != e; b++) if (*b == '\n') { r++; k = l; l = b; }
+#else
+  const char *b = c;
+  while ((b = (const char *) memchr(b, '\n', (size_t) (e - b)))) { r++; k = l; l = b++; }
+#endif
+  if (!r) {
+    p->c += e - c;
+    return;
   }
-  s = (const char *) p->buf;
-  char *c = p->buf + p->len;
+  p->n = k ? l - k : p->c + (l - c); /* column before the last '\n' */
+  p->r += r;
+  p->c = e - l;
+}
+
+#define SML_skip(p,c,e);  if (!lazy) SML_count(p, c, e);
+
+SML_Parser SML_Locate (SML_Parser p) { /* bring r/c/i/n up to the cursor */
+  if (p->lazy && p->i < p->at) SML_count(p, p->buf + (p->i - p->base), p->buf + (p->at - p->base));
+  return p;
+} /* }}} */
+
+/* heurestic smp (sloppy markup parser) {{{ */
+static enum MPState SML_Scan (SML_Parser p, int len, BYTE fEnd) { /* p->buf[p->off + p->len] + len */
+  BYTE lazy = p->lazy;
+  const char *s = (const char *) p->buf + p->off;
+  char *c = (char *) s + p->len;
   char bc = p->len ? *(c - 1) : '\0'; /* character before c */
-  char *e = p->buf + (p->len += len);
+  char *e = c + len;
+  char *b = p->budget && !p->pull && len > (int) p->budget ? c + p->budget : e; /* suspended after */
   char q = p->quote;
 
   BYTE escape = p->mode & M_ESCAPE;
   BYTE sloppy = p->mode & M_SLOPPY;
+  const BYTE *cc = p->cc;
   DBG(2, printf("%x (%x, %x, %x) %d\n", p->mode, s, c, e, len););
 
   do {
     switch (p->mode & S_STATES) {
       case S_TEXT: /* text {{{ */
-        while ((c != e) && (('<' != *c) ||
-             (escape && (((c == s) && bc == '\\') || ((c != s) && *(c - 1) == '\\'))) ||
-             ((c + 1 != e) && (bc = *(c + 1)) && sloppy && /* !good tag */
-               !(bc == '!' || bc == '/' || bc == '?' || bc == '_' ||
-                 (bc >= 'A' && bc <= 'Z') || (bc >= 'a' && bc <= 'z'))))) {
+        while (c != e) {
+          if ('<' != *c) { /* jump to the next candidate */
+            char *t = SML_find(c, e, '<');
+            SML_skip(p, c, t);
+            if ((c = t) == e) break;
+          }
+          if (!(escape && c != s && *(c - 1) == '\\')) { /* text starts after markup: not escaped */
+            if (c + 1 == e && sloppy && !fEnd && !p->zc) { /* markup or not: told by the next char */
+              p->quote = '<';
+              break;
+            }
+            if (c + 1 == e || (cc[(BYTE) (bc = *(c + 1))] & C_TAG)) break; /* good tag */
+          }
           incr(c, p);
         }
-        if (c != e) { /* found markup < */
+        if (p->quote == '<') { /* looked at again with more data */
+          mark(c, p);
+          c = e;
+        }
+        else if (c != e) { /* found markup < */
+          mark(c, p);
           if (c != s) p->ft(p->ud, s, c - s); /* release text */
           s = (const char *) c; /* shift start-pointer */
           p->mode = (p->mode & M_MODES) | S_MARKUP;
         }
         else if (fEnd) {
+          mark(c, p);
           if (c != s) p->ft(p->ud, s, c - s);
           p->mode = (p->mode & M_MODES) | S_DONE;
         }
         break; /* text }}} */
 
+      case S_SKIP: /* skipped element: markup scanned as the parser would, only <name and </name counted {{{ */
+        while (c != e) {
+          if (p->sm == SK_TEXT) { /* next <, s kept a char back for the escape */
+            char *t = SML_find(c, e, '<');
+            SML_skip(p, c, t);
+            if ((c = t) == e) {
+              if (c != s) s = (const char *) c - 1;
+              break;
+            }
+            if (escape && c != s && *(c - 1) == '\\') { /* \< */
+              incr(c, p);
+              s = (const char *) c - 1;
+              continue;
+            }
+            s = (const char *) c; /* s at the '<' until the tag ends */
+            p->sm = SK_NAME;
+            incr(c, p);
+          }
+          else if (p->sm == SK_NAME) { /* token after <, as searched in markup */
+            if (c == s + 1 && !(cc[(BYTE) *c] & C_TAG)) { /* not markup: c looked at again */
+              p->sm = SK_TEXT;
+              continue;
+            }
+            if (s[1] != '!' || c > s + 8) {
+              char *t = c;
+              while (t != e && !(cc[(BYTE) *t] & (C_SPACE | C_DEL | C_GT))) t++;
+              SML_skip(p, c, t);
+              if ((c = t) == e) break;
+            }
+            else if (c == s + 3 && 0 == strncmp(s, "<!--", 4)) {
+              p->sm = SK_COMMENT;
+              incr(c, p);
+              s = (const char *) c;
+              continue;
+            }
+            else if (c == s + 8 && 0 == strncmp(s, "<![CDATA[", 9)) {
+              p->sm = SK_CDATA;
+              incr(c, p);
+              s = (const char *) c;
+              continue;
+            }
+            else if (!(cc[(BYTE) *c] & (C_SPACE | C_DEL | C_GT))) {
+              incr(c, p);
+              continue;
+            }
+            if (*c != '>') { /* space or del */
+              int i = SML_ext(p, s + 1, c - s - 1);
+              if (i >= 0) {
+                p->iExt = (BYTE) i;
+                p->sm = SK_EXT;
+                incr(c, p);
+                s = (const char *) c;
+                continue;
+              }
+            }
+            else if (c == s + 1) { /* <> */
+              p->sm = SK_TEXT;
+              incr(c, p);
+              s = (const char *) c;
+              continue;
+            }
+            { /* a tag: ours or another */
+              const char *t = s + 1;
+              int l = (int) (c - t) - (*c == '>' && *(c - 1) == '/'); /* <name/> */
+              if (l > 0 && *t == '/') { t++; l--; }
+              p->sm = SK_TAG;
+              if ((unsigned int) l == p->lsname && 0 == memcmp(t, p->sname, l)) {
+                p->sm = t == s + 1 ? SK_OPEN : SK_CLOSE;
+                if (p->sm == SK_OPEN) p->skip++;
+              }
+            }
+          }
+          else if (p->sm >= SK_TAG && p->sm <= SK_CLOSE) { /* in the tag: strings and nested < kept */
+            if (p->quote) {
+              char *t = SML_find(c, e, p->quote);
+              SML_skip(p, c, t);
+              if ((c = t) == e) break;
+              if (*(c - 1) != '\\') p->quote = '\0';
+              incr(c, p);
+              continue;
+            }
+            char *t = c;
+            while (t != e && !(cc[(BYTE) *t] & (C_QUOTE | C_LT | C_GT))) t++;
+            SML_skip(p, c, t);
+            if ((c = t) == e) break;
+            if (*c != '>') {
+              if (*c == '<') p->level++;
+              else p->quote = *c;
+              incr(c, p);
+              continue;
+            }
+            if (p->level > 0) {
+              p->level--;
+              incr(c, p);
+              continue;
+            }
+            if (p->sm == SK_CLOSE || (p->sm == SK_OPEN && *(c - 1) == '/')) p->skip--; /* </name> or <name/> */
+            p->sm = SK_TEXT;
+            if (!p->skip) { /* end of the skipped element */
+              mark(c, p);
+              if (p->skipe) {
+                SML_Str name = {p->sname, (int) p->lsname};
+                p->fe(p->ud, name);
+              }
+              p->mode = (p->mode & M_MODES) | S_TEXT;
+              q = '\0';
+            }
+            incr(c, p);
+            s = (const char *) c;
+            if (!p->skip) break;
+          }
+          else { /* comment, cdata or extension: s at its content */
+            if (*c != '>') {
+              char *t = SML_find(c, e, '>');
+              SML_skip(p, c, t);
+              if ((c = t) == e) break;
+            }
+            if (p->sm == SK_EXT) {
+              int l = p->lszExts[p->iExt];
+              if (c - s >= l - 1 && 0 == memcmp(c - l + 1, p->szExts[2 * p->iExt + 1], l)) p->sm = SK_TEXT;
+            }
+            else if (c >= s + 2 && 0 == strncmp(c - 2, p->sm == SK_CDATA ? "]]>" : "-->", 3)) {
+              p->sm = SK_TEXT;
+            }
+            incr(c, p);
+            if (p->sm == SK_TEXT) s = (const char *) c;
+          }
+        }
+        break; /* skipped element }}} */
+
       case S_STRING: /* string in tag {{{ */
-        while (c != e && (*c != q || *(c - 1) == '\\')) {
+        while (c != e) {
+          char *t = SML_find(c, e, q);
+          SML_skip(p, c, t);
+          if ((c = t) == e || *(c - 1) != '\\') break;
           incr(c, p);
         }
         if (c != e) {
@@ -203,6 +623,7 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
           p->mode = (p->mode & M_MODES) | S_MARKUP | F_TOKEN;
           p->quote = q = '\0'; /* reset quote */
         }
+        if (c == e && !fEnd) break; /* wait for more data */
         /* string in tag }}} */
 
       case S_MARKUP: /* markup {{{ */
@@ -220,59 +641,58 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
         */
         if (p->mode & F_TOKEN) { /* token found {{{ */
           do {
+            if (c != e && !(cc[(BYTE) *c] & (C_SPACE | C_QUOTE | C_LT | C_GT))) { /* plain characters */
+              char *t = c;
+              while (++t != e && !(cc[(BYTE) *t] & (C_SPACE | C_QUOTE | C_LT | C_GT)));
+              SML_skip(p, c, t);
+              if ((c = t) == e) break;
+            }
+            if (c == e && !fEnd) break;
             if ((c == e && fEnd) || *c == '>') {
               BYTE closing = (c == e && fEnd); /* or end of parsing */
-              Glnk *attr;
-              if (p->level > 0) {
+              if (p->level > 0 && !closing) {
                 p->level--;
-                if (s != c) { /* collect attributes */
-                  attr = stGlnkPop(); attr->next = p->attr; p->attr = attr;
-                  attr->data = (void *) s; *c = '\0';
-                }
-                attr = stGlnkPop(); attr->next = p->attr; p->attr = attr;
-                attr->data = (void *) mue;
+                if (s != c) SML_push(p, s, c - s); /* collect attributes */
+                SML_push(p, c, 1);
                 s = (const char *) c + 1;
               }
               else { /* closing */
-                bc = p->elem[0];
+                BYTE next = S_TEXT;
+                mark(c, p);
+                bc = p->elem.len ? p->elem.s[0] : '\0';
 
-                if (s != c && s != p->elem) { /* last attr */
-                  *c = '\0';
+                if (s != c) { /* last attr */
+                  const char *t = c;
                   if (bc == '?' && *(c - 1) == '?') {
-                    *(c - 1) = '\0';
+                    t--;
                   }
-                  else if (((bc == '_') ||
-                           ((bc >= 'a') && (bc <= 'z')) ||
-                           ((bc >= 'A') && (bc <= 'Z'))) &&
-                           *(c - 1) == '/') {
-                    *(c - 1) = '\0';
+                  else if ((cc[(BYTE) bc] & C_NAME) && *(c - 1) == '/') {
+                    t--;
                     closing = 0x01; /* also closing */
                   }
-                  if (*s != '\0') {
-                    attr = stGlnkPop(); attr->next = p->attr; p->attr = attr;
-                    attr->data = (void *) s;
-                  }
+                  if (t != s) SML_push(p, s, t - s);
                 }
 
                 if (bc == '/') { /* clean attribute */
-                  while (p->attr) { /* clean attr or error if strict */
-                    attr = p->attr; p->attr = attr->next; stGlnkPush(attr);
-                  }
+                  p->nattr = 0; /* clean attr or error if strict */
                   p->fe(p->ud, p->elem);
                 }
-                else if ((bc != '_') &&
-                        !((bc >= 'a') && (bc <= 'z')) &&
-                        !((bc >= 'A') && (bc <= 'Z'))) {
+                else if (!(cc[(BYTE) bc] & C_NAME)) {
                   /* scheme/definition/declaration <!.. ...> <?.. ...> etc */
                   p->fd(p->ud, p->elem, SML_attr(p));
                 }
+                else if (SML_listed(p)) { /* dropped with its content */
+                  p->nattr = 0;
+                  if (!closing) next = SML_skipto(p, 0);
+                }
                 else { /* regular tag <*.. ...> */
-                  p->fs(p->ud, p->elem, SML_attr(p));
+                  p->sreq = 0;
+                  p->fs(p->ud, p->elem, p->pairs ? SML_pairs(p) : SML_attr(p));
                   if (closing) p->fe(p->ud, p->elem);
+                  else if (p->sreq) next = SML_skipto(p, 1);
                 }
-                free(p->elem);
-                p->elem = NULL;
-                p->mode = (p->mode & M_MODES) | S_TEXT;
+                SML_drop(p);
+                p->mode = (p->mode & M_MODES) | next;
                 if (c != e || !fEnd) {
                   incr(c, p);
                   s = (const char *) c;
@@ -287,19 +707,10 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
               break;
             }
             else if (*c <= ' ' || *c == '<') { /* < or space */
-              BYTE opening = 0;
-              Glnk *attr;
+              if (s != c) SML_push(p, s, c - s); /* collect attributes */
               if (*c == '<') {
                 p->level++;
-                opening = 1;
-              }
-              if (s != c) { /* collect attributes */
-                attr = stGlnkPop(); attr->next = p->attr; p->attr = attr;
-                attr->data = (void *) s; *c = '\0';
-              }
-              if (opening) {
-                attr = stGlnkPop(); attr->next = p->attr; p->attr = attr;
-                attr->data = (void *) mus;
+                SML_push(p, c, 1);
               }
               s = (const char *) c + 1;
             }
@@ -308,9 +719,17 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
         } /* }}} */
         else { /* searching token {{{ */
           do {
+            if (c != e && c > s && !(cc[(BYTE) *c] & (C_SPACE | C_DEL | C_GT)) &&
+                (s[1] != '!' || c > s + 8)) { /* past <!-- and <![CDATA[ */
+              char *t = c;
+              while (++t != e && !(cc[(BYTE) *t] & (C_SPACE | C_DEL | C_GT)));
+              SML_skip(p, c, t);
+              if ((c = t) == e) break;
+            }
             if (c == e && fEnd) {
-              p->elem = strndup(s, c - s);
-              p->fs(p->ud, p->elem, SML_attr(p));
+              mark(c, p);
+              SML_elem(p, s, c - s);
+              p->fs(p->ud, p->elem, p->pairs ? SML_pairs(p) : SML_attr(p));
               s = (const char *) c;
               break;
             }
@@ -326,12 +745,12 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
               s = (const char *) c;
               break;
             }
-            else if ((bc = *c) && (bc <= ' ' || bc == 0x7F)) { /* space or del */
-              int i, n = c - s++;
-              for (i = 0; i < p->Exts; i++) if (strncmp(s, p->szExts[2 * i], n) == 0) break;
-              p->iExt = i;
-              p->elem = strndup(s, c - s);
-              if (i < p->Exts) {
+            else if ((bc = *c) && (cc[(BYTE) bc] & (C_SPACE | C_DEL))) { /* space or del */
+              s++;
+              int i = SML_ext(p, s, c - s);
+              SML_elem(p, s, c - s);
+              if (i >= 0) {
+                p->iExt = (BYTE) i;
                 p->mode = (p->mode & M_MODES) | S_CDATA;
               }
               else {
@@ -339,7 +758,7 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
               }
               incr(c, p);
               s = (const char *) c;
-              DBG(1, printf("TOKEN1 (%s)%x\n", p->elem, p->mode););
+              DBG(1, printf("TOKEN1 (%.*s)%x\n", p->elem.len, p->elem.s, p->mode););
               break;
             }
             else if (bc == '>') {
@@ -349,40 +768,45 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
               }
               else { /* <*> */
                 p->mode |= F_TOKEN;
-                if (*(c - 1) == '/') c--; // FIX <*/>
-                p->elem = strndup(s, c - s);
-                DBG(1, printf("TOKEN2 (%s)%x\n", p->elem, p->mode););
+                if (*(c - 1) == '/') { /* FIX <br/>: the '/' is looked at again, counted once */
+                  c--;
+                  if (!lazy) { p->c--; p->i--; }
+                }
+                SML_elem(p, s, c - s);
+                DBG(1, printf("TOKEN2 (%.*s)%x\n", p->elem.len, p->elem.s, p->mode););
               }
               s = (const char *) c;
               break;
             }
-            if (*(c++) == '\n') { p->n = p->c; p->r++; p->c = 0; }
-            p->c++;
-            p->i++;
+            incr(c, p);
           } while (c != e);
         } /* }}} */
         break; /* markup }}} */
 
       case S_CDATA: case S_COMMENT: /* CDATA, COMMENT, and other Extensions {{{ */
         while (c != e) {
+          if (*c != '>') {
+            char *t = SML_find(c, e, '>');
+            SML_skip(p, c, t);
+            if ((c = t) == e) break;
+          }
           if (*c == '>') {
-            if (p->elem) { /* ext tag */
-              int l = p->lszExts[p->iExt * 2 + 1];
-              if (0 == strncmp(c - l + 1, p->szExts[p->iExt], l)) {
-                *(c - l + 1) = '\0';
+            mark(c, p);
+            if (p->elem.s) { /* ext tag */
+              int l = p->lszExts[p->iExt];
+              if (c - s >= l - 1 && 0 == memcmp(c - l + 1, p->szExts[2 * p->iExt + 1], l)) {
                 p->fx(p->ud, p->elem, s, c - l + 1 - s);
+                SML_drop(p);
                 break;
               }
             }
             else if (((p->mode & S_STATES) == S_CDATA) &&
-                (0 == strncmp(c - 2, "]]>", 3))) {
-              *(c - 2) = '\0';
+                c >= s + 2 && (0 == strncmp(c - 2, "]]>", 3))) {
               p->ft(p->ud, s, c - 2 - s); /* cdata text */
               break;
             }
             else if (((p->mode & S_STATES) == S_COMMENT) &&
-                (0 == strncmp(c - 2, "-->", 3)) && c >= s + 2 ) {
-              *(c - 2) = '\0';
+                c >= s + 2 && (0 == strncmp(c - 2, "-->", 3))) {
               p->fc(p->ud, s, c - 2 - s); /* comment */
               break;
             }
@@ -395,7 +819,8 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
           s = (const char *) c;
         }
         else if (fEnd && (c != s)) {
-          if (p->elem)
+          mark(c, p);
+          if (p->elem.s)
             p->fx(p->ud, p->elem, s, c - s);
           else if ((p->mode & S_STATES) == S_CDATA)
             p->ft(p->ud, s, c - s);
@@ -405,161 +830,707 @@ enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
         }
         /* CDATA, COMMENT, and other Extensions }}} */
     }
-  } while (c != e);
-
+  } while (c != e ? !(p->pull ? p->pull->nq : c >= b) : (fEnd && len && !(len = 0))); /* at the end once more */
+
+  mark(c, p);
+  if (c != e) { /* stopped: events to pull, or the budget used */
+    p->off = s - p->buf;
+    p->len = c - s;
+    p->rest = e - c;
+    return p->pull ? MPSok : MPSsuspended;
+  }
   if (fEnd) {
     DBG(2, printf("End %x (%x, %x, %x) %d\n", p->mode, s, c, e, len););
     p->mode = (M_MODES & p->mode) | ((c == e) ? S_DONE : S_ERROR);
     p->fz(p->ud);
+    SML_drop(p); /* document boundary */
     return (c == e) ? MPSfinished : MPSerror;
   }
-  if ((p->len = e - s)) memmove(p->buf, s, p->len);
+  p->off = s - p->buf; /* the tail stays in place */
+  p->len = e - s;
   return MPSok;
-} /* }}} */
+}
 
-/***************************************************************/
-/********************* lua library related *********************/
-/***************************************************************/
-/* lua ud + evnt handlers {{{ */
+static void SML_room (SML_Parser p, unsigned int len) { /* for len more bytes after the tail */
+  unsigned int k = p->off; /* first byte kept: the tail or the attributes of an open tag */
+  if (p->nattr && p->attr[0].off < k) k = p->attr[0].off;
+  unsigned int n = p->off + p->len + p->rest - k;
+  if (p->lazy && p->i < p->base + k) /* index lines before dropping them */
+    SML_count(p, p->buf + (p->i - p->base), p->buf + k);
+  if (k < n || n + len > p->size) { /* grow geometrically: amortized O(1) per byte */
+    char *buf = p->buf;
+    unsigned int size = p->size ? p->size * 2 : (p->hint ? p->hint : SML_CHUNK);
+    while (size < n + len) size *= 2;
+    p->buf = (char *) malloc(p->size = size);
+    if (n) memcpy(p->buf, buf + k, n);
+    free(buf);
+  }
+  else if (n) { /* compact: no more than what is dropped */
+    memmove(p->buf, p->buf + k, n);
+  }
+  unsigned int i;
+  for (i = 0; i < p->nattr; i++) p->attr[i].off -= k;
+  p->base += k;
+  p->off -= k;
+}
 
-#include "lua.h"
-#include "lauxlib.h"
+static int SML_back (SML_Parser p, int len) { /* adjust last parsed result: scanned up to the end */
+  if (((p->mode & S_STATES) == S_TEXT) && p->quote == '<') { /* the last '<' */
+    p->quote = '\0';
+    p->len--;
+    len++;
+  }
+  else if (len && ((p->mode & S_STATES) == S_TEXT) && p->len && p->buf[p->off + p->len] == '<') {
+    p->len--;
+    len++;
+    if (!p->lazy || p->i == p->at) {
+      if (p->buf[p->off + p->len] != '\n') { p->c--; } else { p->r--; p->c = p->n; } /* or col of last line */
+      p->i--;
+    }
+    p->at--;
+  }
+  return len;
+}
 
-#if (LUA_VERSION_NUM > 503)
-#define lua_newuserdata(L, u)    lua_newuserdatauv(L, u, 1)
-#define lua_setuservalue(L, i)   lua_setiuservalue(L, i, 1)
-#define lua_getuservalue(L, i)   lua_getiuservalue(L, i, 1)
-#endif
+enum MPState SML_Parse (SML_Parser p, const char *s, int len) {
+  if (len && (p->mode & S_STATES) == S_DONE) return MPSerror;
+  BYTE fEnd = (s == NULL);
 
-#if !defined(lua_pushliteral)
-#define lua_pushliteral(L, s)    lua_pushstring(L, "" s, (sizeof(s)/sizeof(char))-1)
-#endif
+  if (len) { /* append to p->buf */
+    if (p->size < p->off + p->len + p->rest + len) SML_room(p, len);
+    memcpy(p->buf + p->off + p->len + p->rest, s, len);
+  }
+  else if (!fEnd && !p->rest) {
+    return MPSok;
+  }
 
-#define ParserType  "MarkupParser"
+  p->fin |= fEnd; /* kept while suspended */
+  if (p->rest) { /* not scanned up to the end yet: that first, as without budget */
+    len += p->rest;
+    p->rest = 0;
+    if (p->pull) { /* scanned by SML_Next */
+      p->rest = len;
+      return MPSok;
+    }
+    enum MPState state = SML_Scan(p, len, 0);
+    if (state != MPSok || !p->fin) return state;
+    len = 0;
+  }
+  len = SML_back(p, len);
+  if (p->pull) {
+    p->rest = len;
+    return MPSok;
+  }
+  return SML_Scan(p, len, p->fin);
+}
 
-typedef struct lsmp_userdata {
-  lua_State *L;
-  SML_Parser parser;    /* associated sml p */
-  int errorref;         /* reference to error message */
-  enum MPState state;
-} lsmp_ud;
+enum MPState SML_ParseBuffer (SML_Parser p, const char *s, int len) { /* whole document */
+  if (p->off || p->len || p->base || p->pull || p->budget || (p->mode & S_STATES) != S_TEXT) { /* streaming */
+    enum MPState state = SML_Parse(p, s, len);
+    if (state == MPSsuspended) p->fin = 1; /* the end, once resumed */
+    return (state == MPSok) ? SML_Parse(p, NULL, 0) : state;
+  }
+  char *buf = p->buf;
+  p->buf = (char *) s; /* read only: callbacks get slices of s */
+  p->zc = 1;
+  enum MPState state = SML_Scan(p, len, 0);
+  if (state == MPSok) state = SML_Scan(p, 0, 1);
+  SML_Locate(p); /* before s goes away */
+  p->zc = 0;
+  p->buf = buf;
+  p->off = p->len = 0;
+  return state;
+}
 
-/* Auxiliary function to call a Lua handle */
-static void docall (lsmp_ud *mpu, int nargs, int nres) {
-  lua_State *L = mpu->L;
-  assert(mpu->state == MPSok);
-  if (lua_pcall(L, nargs, nres, 0) != 0) {
-    mpu->state = MPSerror;
-    mpu->errorref = luaL_ref(L, LUA_REGISTRYINDEX);  /* error message */
+/* pull: SML_SetPull(p) before parsing, SML_Parse(p, s, len) to feed, SML_Next(p, &ev) {{{ */
+static unsigned int pull_str (struct SML_Pull *q, const char *s, int len) { /* offset of the copy */
+  if (len <= 0) return q->ns;
+  if (q->ns + len > q->ms) {
+    while (q->ns + len > q->ms) q->ms = q->ms ? q->ms * 2 : 1024;
+    q->s = (char *) realloc(q->s, q->ms);
   }
+  memcpy(q->s + q->ns, s, (size_t) len);
+  q->ns += len;
+  return q->ns - len;
 }
 
-/*
-Check whether there is a Lua handle for a given event: If so,
-put it on the stack (to be called later), and also push `self'
-*/
-static int getHandle (lsmp_ud *mpu, const char *handle) {
-  lua_State *L = mpu->L;
-  if (mpu->state == MPSerror) return 0;
-  lua_getuservalue(L, 1);
-  lua_pushstring(L, handle);
-  lua_gettable(L, 2);
-  if (lua_isnil(L, -1)) return 0;
-  if (!lua_isfunction(L, -1)) {
-    luaL_error(L, "lsmp '%s' callback is not a function", handle);
+static SML_Qev *pull_ev (void *ud, int type, SML_Str name, const char *s, int len) {
+  struct SML_Pull *q = ((SML_Parser) ud)->pull;
+  if (q->nq == q->mq) q->q = (SML_Qev *) realloc(q->q, sizeof(SML_Qev) * (q->mq = q->mq ? q->mq * 2 : 8));
+  SML_Qev *v = q->q + q->nq++;
+  v->type = (BYTE) type;
+  v->lname = name.len;
+  v->name = pull_str(q, name.s, name.len);
+  v->ldata = len;
+  v->data = pull_str(q, s, len);
+  v->attr = q->na;
+  v->nattr = 0;
+  v->tok = 0;
+  return v;
+}
+
+static void pull_attrs (struct SML_Pull *q, SML_Qev *v, const SML_Str *attrs, int pairs) {
+  for (; attrs->s; attrs++, v->nattr++) {
+    if (q->na == q->ma) q->a = (SML_Tok *) realloc(q->a, sizeof(SML_Tok) * (q->ma = q->ma ? q->ma * 2 : 16));
+    SML_Tok *t = q->a + q->na++;
+    t->off = pull_str(q, attrs->s, attrs->len);
+    t->len = attrs->len;
+    if (pairs) { /* and the value */
+      if (q->na == q->ma) q->a = (SML_Tok *) realloc(q->a, sizeof(SML_Tok) * (q->ma *= 2));
+      t = q->a + q->na++;
+      attrs++;
+      v->nattr++;
+      t->off = pull_str(q, attrs->s, attrs->len);
+      t->len = attrs->s ? attrs->len : -1;
+    }
   }
-  lua_pushvalue(L, 1);  /* 1st arg (ud) in every call (self) */
-  return 1;
+  v->tok = (BYTE) attrs->len; /* the end of pairs */
 }
 
-/*********** SAX event handler *************/
+static void pull_Start (void *ud, SML_Str name, const SML_Str *attrs) {
+  SML_Qev *v = pull_ev(ud, SML_START, name, NULL, 0);
+  pull_attrs(((SML_Parser) ud)->pull, v, attrs, ((SML_Parser) ud)->pairs);
+}
 
-void f_Closing (void *ud) {
-  lsmp_ud *mpu = (lsmp_ud *) ud;
-  if (getHandle(mpu, ClosingKey)) docall(mpu, 1, 0);
+static void pull_Scheme (void *ud, SML_Str name, const SML_Str *attrs) {
+  SML_Qev *v = pull_ev(ud, SML_SCHEME, name, NULL, 0);
+  pull_attrs(((SML_Parser) ud)->pull, v, attrs, 0);
 }
 
-void f_CharData (void *ud, const char *s, int len) {
-  lsmp_ud *mpu = (lsmp_ud *) ud;
-  if (getHandle(mpu, CharacterDataKey) && mpu->state == MPSok) {
-    lua_pushlstring(mpu->L, s, len);
-    docall(mpu, 1 + 1, 0);
-  }
+static void pull_End (void *ud, SML_Str name) {
+  pull_ev(ud, SML_END, name, NULL, 0);
 }
 
-void f_Comment (void *ud, const char *s, int len) {
-  lsmp_ud *mpu = (lsmp_ud *) ud;
-  if (getHandle(mpu, CommentKey)) {
-    lua_pushlstring(mpu->L, s, len);
-    docall(mpu, 1 + 1, 0);
-  }
+static void pull_CharData (void *ud, const char *s, int len) {
+  SML_Str none = {NULL, 0};
+  pull_ev(ud, SML_TEXT, none, s, len);
 }
 
-void f_Extension (void *ud, const char *name, const char *s, int len) {
-  lsmp_ud *mpu = (lsmp_ud *) ud;
-  if (getHandle(mpu, ExtensionKey)) {
-    lua_pushstring(mpu->L, name);
-    lua_pushlstring(mpu->L, s, len);
-    docall(mpu, 1 + 2, 0);
-  }
+static void pull_Comment (void *ud, const char *s, int len) {
+  SML_Str none = {NULL, 0};
+  pull_ev(ud, SML_COMMENT, none, s, len);
 }
 
-void f_Scheme (void *ud, const char *name, const char **attrs) {
-  lsmp_ud *mpu = (lsmp_ud *) ud;
-  if (getHandle(mpu, SchemeKey)) {
-    lua_State *L = mpu->L;
-    lua_pushstring(L, name);
-    lua_newtable(L);
-    int i = 1;
-    while (*attrs) {
-      lua_pushinteger(L, i++);
-      lua_pushstring(L, *(attrs++));
-      lua_settable(L, -3); /* leave lua callback to parse attr */
-    }
-    /* call function with self, name, and attributes */
-    docall(mpu, 1 + 2, 0);
-  }
+static void pull_Extension (void *ud, SML_Str name, const char *s, int len) {
+  pull_ev(ud, SML_EXT, name, s, len);
 }
 
-void f_StartElement (void *ud, const char *name, const char **attrs) {
-  lsmp_ud *mpu = (lsmp_ud *) ud;
-  if (getHandle(mpu, StartElementKey)) {
-    lua_State *L = mpu->L;
-    lua_pushstring(L, name);
-    lua_newtable(L);
-    int i = 1;
-    while (*attrs) {
-      lua_pushinteger(L, i++);
-      lua_pushstring(L, *(attrs++));
-      lua_settable(L, -3); /* leave lua callback to parse attr */
-    }
-    /* call function with self, name, and attributes */
-    docall(mpu, 1 + 2, 0);
-  }
+static void pull_Closing (void *ud) {
+  SML_Str none = {NULL, 0};
+  pull_ev(ud, SML_CLOSING, none, NULL, 0);
 }
 
-void f_EndElement (void *ud, const char *name) {
-  lsmp_ud *mpu = (lsmp_ud *) ud;
-  if (getHandle(mpu, EndElementKey)) {
-    lua_pushstring(mpu->L, name);
-    docall(mpu, 1 + 1, 0);
+void SML_SetPull (SML_Parser p) { /* events are queued for SML_Next: ud and handlers taken over */
+  if (p->pull) return;
+  p->pull = (struct SML_Pull *) calloc(1, sizeof(struct SML_Pull));
+  p->ud = p;
+  p->ft = pull_CharData;
+  p->fs = pull_Start;
+  p->fe = pull_End;
+  p->fc = pull_Comment;
+  p->fd = pull_Scheme;
+  p->fx = pull_Extension;
+  p->fz = pull_Closing;
+}
+
+int SML_Next (SML_Parser p, SML_Event *ev) { /* 1: the next event in ev; 0: more data wanted, or done */
+  struct SML_Pull *q = p->pull;
+  if (!q) return 0;
+  while (q->iq == q->nq) { /* scan up to the next events */
+    BYTE state = p->mode & S_STATES;
+    if (state == S_DONE || state == S_ERROR || (!p->rest && !p->fin)) return 0;
+    q->iq = q->nq = q->ns = q->na = 0;
+    unsigned int len = p->rest;
+    p->rest = 0;
+    if (len) SML_Scan(p, (int) len, 0);
+    else SML_Scan(p, SML_back(p, 0), 1); /* the end */
+  }
+  SML_Qev *v = q->q + q->iq++;
+  ev->type = v->type;
+  ev->name.s = q->s + v->name;
+  ev->name.len = (int) v->lname;
+  ev->data.s = q->s + v->data;
+  ev->data.len = (int) v->ldata;
+  if (v->nattr + 1 > q->mout) q->out = (SML_Str *) realloc(q->out, sizeof(SML_Str) * (q->mout = v->nattr + 8));
+  unsigned int i;
+  for (i = 0; i < v->nattr; i++) {
+    SML_Tok *t = q->a + v->attr + i;
+    q->out[i].s = t->len < 0 ? NULL : q->s + t->off;
+    q->out[i].len = t->len < 0 ? 0 : t->len;
   }
+  q->out[i].s = NULL;
+  q->out[i].len = v->tok;
+  ev->attrs = q->out;
+  return 1;
 } /* }}} */
 
-/**************** required and their assistant *************** {{{ */
+/* parallel: SML_ParseThreads(p, s, len, threads), SML_ParseBuffer on threads {{{
+** s is cut before the '<' of tags into parts, all scanned at once by parsers like p recording
+** their events. A part holds if the scan before it ends in plain text, as a scan from the start
+** would reach it; else (it began in a comment, cdata, string, tag or skipped element) that scan
+** goes on through it. The records are then replayed into the handlers of p, in order.
+*/
+typedef struct SML_Rec { SML_Str *ev; unsigned int nev, mev; } SML_Rec; /* {NULL, n << 3 | type}, then its n slices */
 
-static int getcallbacks (lua_State *L) {
+static SML_Str *rec_add (SML_Rec *t, int e, unsigned int n) { /* room for the n slices of e */
+  if (t->nev + n + 1 > t->mev) {
+    while (t->nev + n + 1 > t->mev) t->mev = t->mev ? t->mev * 2 : 1024;
+    t->ev = (SML_Str *) realloc(t->ev, sizeof(SML_Str) * t->mev);
+  }
+  SML_Str *v = t->ev + t->nev;
+  v->s = NULL;
+  v->len = (int) (n << 3 | e);
+  t->nev += n + 1;
+  return v + 1;
+}
+
+static void rec_str (SML_Rec *t, int e, SML_Str name, const SML_Str *attrs, int pairs) {
+  unsigned int n = 0;
+  while (attrs[n].s) n += pairs ? 2 : 1;
+  SML_Str *v = rec_add(t, e, n + 2); /* name, attrs, NULL */
+  *v++ = name;
+  memcpy(v, attrs, sizeof(SML_Str) * (n + 1));
+}
+
+static void rec_Start (void *ud, SML_Str name, const SML_Str *attrs) { /* paired */
+  rec_str((SML_Rec *) ud, SML_START, name, attrs, 1);
+}
+
+static void rec_Attrs (void *ud, SML_Str name, const SML_Str *attrs) { /* start, atts not paired */
+  rec_str((SML_Rec *) ud, SML_START, name, attrs, 0);
+}
+
+static void rec_Scheme (void *ud, SML_Str name, const SML_Str *attrs) {
+  rec_str((SML_Rec *) ud, SML_SCHEME, name, attrs, 0);
+}
+
+static void rec_End (void *ud, SML_Str name) {
+  *rec_add((SML_Rec *) ud, SML_END, 1) = name;
+}
+
+static void rec_CharData (void *ud, const char *s, int len) {
+  SML_Str *v = rec_add((SML_Rec *) ud, SML_TEXT, 1);
+  v->s = s;
+  v->len = len;
+}
+
+static void rec_Comment (void *ud, const char *s, int len) {
+  SML_Str *v = rec_add((SML_Rec *) ud, SML_COMMENT, 1);
+  v->s = s;
+  v->len = len;
+}
+
+static void rec_Extension (void *ud, SML_Str name, const char *s, int len) {
+  SML_Str *v = rec_add((SML_Rec *) ud, SML_EXT, 2);
+  v[0] = name;
+  v[1].s = s;
+  v[1].len = len;
+}
+
+static void rec_Closing (void *ud) {
+  rec_add((SML_Rec *) ud, SML_CLOSING, 0);
+}
+
+static void SML_Record (SML_Parser p, SML_Rec *t) { /* events of p into t, slices of what is parsed */
+  p->ud = t;
+  p->ft = rec_CharData;
+  p->fs = p->pairs ? rec_Start : rec_Attrs;
+  p->fe = rec_End;
+  p->fc = rec_Comment;
+  p->fd = rec_Scheme;
+  p->fx = rec_Extension;
+  p->fz = rec_Closing;
+}
+
+static void SML_Play (SML_Parser p, const SML_Rec *t) { /* t into the handlers of p */
+  const SML_Str *v = t->ev, *e = v + t->nev;
+  while (v != e) {
+    int n = v->len >> 3, k = v->len & 7;
+    v++;
+    switch (k) {
+      case SML_START: p->fs(p->ud, v[0], v + 1); break;
+      case SML_END: p->fe(p->ud, v[0]); break;
+      case SML_TEXT: p->ft(p->ud, v[0].s, v[0].len); break;
+      case SML_COMMENT: p->fc(p->ud, v[0].s, v[0].len); break;
+      case SML_SCHEME: p->fd(p->ud, v[0], v + 1); break;
+      case SML_EXT: p->fx(p->ud, v[0], v[1].s, v[1].len); break;
+      case SML_CLOSING: p->fz(p->ud); break;
+    }
+    v += n;
+  }
+}
+
+typedef struct SML_Part {
+  SML_Parser p;        /* scanning s[a..b) in place, recording into rec */
+  SML_Rec rec;
+  int a, b;
+  BYTE last, run;      /* b is the end of s; on a thread */
+  enum MPState state;
+} SML_Part;
+
+static SML_Parser SML_Fork (SML_Parser p) { /* mode, extensions, skipped elements and pairs of p */
+  char *ext = NULL, *skip = NULL;
+  int i;
+  if (p->Exts) { /* 'op cl op cl' again */
+    size_t l = 0;
+    for (i = 0; i < 2 * p->Exts; i++) l += strlen(p->szExts[i]) + 1;
+    char *t = ext = (char *) malloc(l);
+    for (i = 0; i < 2 * p->Exts; i++) t += sprintf(t, i ? " %s" : "%s", p->szExts[i]);
+  }
+  if (p->Skips) { /* kept as given */
+    size_t l = p->szSkips[p->Skips - 1].s + p->szSkips[p->Skips - 1].len - p->szSkips[0].s;
+    skip = (char *) memcpy(malloc(l + 1), p->szSkips[0].s, l);
+    skip[l] = '\0';
+  }
+  SML_Parser q = SML_ParserCreate(NULL, (p->mode & M_MODES) | M_LAZY, ext);
+  if (q) {
+    q->pairs = p->pairs;
+    SML_SetSkip(q, skip);
+  }
+  free(ext);
+  free(skip);
+  return q;
+}
+
+static int SML_cut (SML_Parser p, const char *s, int a, int len) { /* '<' of the first tag in s[a..len), or len */
+  BYTE escape = p->mode & M_ESCAPE; /* a part never ends with '<': a tag or not, told by what follows */
+  while (a < len) {
+    const char *c = SML_find((char *) s + a, s + len, '<');
+    if (c + 1 >= s + len) break;
+    if ((p->cc[(BYTE) c[1]] & C_TAG) && c[-1] != '<' && !(escape && c[-1] == '\\')) return c - s;
+    a = c - s + 1;
+  }
+  return len;
+}
+
+static void *SML_part (void *arg) { /* scan the part on from where its parser is */
+  SML_Part *t = (SML_Part *) arg;
+  t->state = SML_Scan(t->p, t->b - t->a, 0);
+  if (t->state == MPSok && t->last) t->state = SML_Scan(t->p, 0, 1);
+  return NULL;
+}
+
+static void SML_unfork (SML_Part *t) {
+  if (t->p) {
+    t->p->buf = NULL; /* not its own */
+    SML_ParserFree(t->p);
+  }
+  free(t->rec.ev);
+  t->p = NULL;
+  t->rec.ev = NULL;
+}
+
+enum MPState SML_ParseThreads (SML_Parser p, const char *s, int len, int threads) { /* whole document */
+  if (threads > len / SML_SPLIT) threads = len / SML_SPLIT;
+  if (threads < 2 || p->off || p->len || p->base || p->pull || p->budget || (p->mode & S_STATES) != S_TEXT)
+    return SML_ParseBuffer(p, s, len);
+
+  SML_Part *t = (SML_Part *) calloc((size_t) threads, sizeof(SML_Part)), *u = t;
+  pthread_t *tid = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+  int n = 0, a = 0, k;
+  while (a < len) { /* parts */
+    int b = SML_cut(p, s, (int) ((long long) len * (n + 1) / threads), len);
+    if (b <= a) b = SML_cut(p, s, a + 1, len);
+    if (n + 1 == threads) b = len;
+    u = t + n++;
+    if (!(u->p = SML_Fork(p))) break;
+    SML_Record(u->p, &u->rec);
+    u->p->buf = (char *) s; /* read only, as SML_ParseBuffer: lines counted from s[0] */
+    u->p->zc = 1;
+    u->p->off = u->a = a;
+    u->b = a = b;
+    u->last = b == len;
+  }
+  if (!u->p) { /* no parser */
+    for (k = 0; k < n; k++) SML_unfork(t + k);
+    free(t);
+    free(tid);
+    return SML_ParseBuffer(p, s, len);
+  }
+  for (k = 1; k < n; k++) t[k].run = !pthread_create(tid + k, NULL, SML_part, t + k);
+  SML_part(t);
+  for (k = 1; k < n; k++) {
+    if (t[k].run) pthread_join(tid[k], NULL);
+    else SML_part(t + k); /* no thread: here */
+  }
+  free(tid);
+
+  for (u = t, k = 1; k < n; k++) { /* u: the scan that reached part k */
+    SML_Parser q = u->p;
+    if ((q->mode & (S_STATES | F_TOKEN)) == S_TEXT && !q->quote) { /* part k holds: its '<' ends the text */
+      if (q->len) rec_CharData(&u->rec, q->buf + q->off, (int) q->len);
+      SML_Play(p, &u->rec);
+      SML_unfork(u);
+      u = t + k;
+    }
+    else { /* u goes on through part k */
+      SML_unfork(t + k);
+      u->b = t[k].b;
+      u->a = t[k].a;
+      u->last = t[k].last;
+      SML_part(u);
+    }
+  }
+  SML_Play(p, &u->rec);
+  enum MPState state = u->state;
+  SML_Locate(u->p);
+  p->r = u->p->r;
+  p->c = u->p->c;
+  p->n = u->p->n;
+  p->i = p->at = u->p->i;
+  p->mode = (p->mode & M_MODES) | (u->p->mode & S_STATES);
+  SML_unfork(u);
+  free(t);
+  return state;
+} /* }}} */
+
+/***************************************************************/
+/********************* lua library related *********************/
+/***************************************************************/
+#ifndef SML_NOLUA /* -DSML_NOLUA: the C parser alone */
+/* lua ud + evnt handlers {{{ */
+
+#include "lua.h"
+#include "lauxlib.h"
+#include <zlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#if (LUA_VERSION_NUM > 503)
+#define lua_newuserdata(L, u)    lua_newuserdatauv(L, u, 1)
+#define lua_setuservalue(L, i)   lua_setiuservalue(L, i, 1)
+#define lua_getuservalue(L, i)   lua_getiuservalue(L, i, 1)
+#endif
+
+#if !defined(lua_pushliteral)
+#define lua_pushliteral(L, s)    lua_pushstring(L, "" s, (sizeof(s)/sizeof(char))-1)
+#endif
+
+#define ParserType  "MarkupParser"
+
+enum { H_SCHEME, H_START, H_END, H_TEXT, H_COMMENT, H_EXT, H_CLOSING, H_EVENTS, H_N }; /* handlers */
+
+static const char *hkeys[H_N] = {
+  SchemeKey, StartElementKey, EndElementKey, CharacterDataKey, CommentKey, ExtensionKey, ClosingKey,
+  EventsKey
+};
+
+typedef struct lsmp_userdata {
+  lua_State *L;
+  SML_Parser parser;    /* associated sml p */
+  int errorref;         /* reference to error message */
+  int href[H_N];        /* references to handlers, LUA_NOREF if none */
+  int batch, nev, hev;  /* events per Events call, recorded, handler of the current one */
+  int evref;            /* reference to the event table (batch) */
+  const SML_Str *attrs; /* of the last event pulled (p:attr), NULL if none */
+  BYTE apairs;          /* attrs as key/value pairs */
+  BYTE yield;           /* handlers may yield: events queued and dispatched by parse_run */
+  unsigned int from;    /* scanned up to, when parse was called (yield with budget) */
+  enum MPState state;
+} lsmp_ud;
+
+/* Events(self, events, n) with events[3i-2 .. 3i] = handler key, arg1, arg2;
+** the event table is at stack index 3 while parsing, and keeps the keys at [-1 - h] */
+#define EVENTS  3
+
+static void flush (lsmp_ud *mpu) {
+  lua_State *L = mpu->L;
+  if (!mpu->nev || mpu->state == MPSerror) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mpu->href[H_EVENTS]);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, EVENTS);
+  lua_pushinteger(L, mpu->nev);
+  mpu->nev = 0;
+  if (lua_pcall(L, 3, 0, 0) != 0) {
+    mpu->state = MPSerror;
+    mpu->errorref = luaL_ref(L, LUA_REGISTRYINDEX);  /* error message */
+  }
+}
+
+static void record (lsmp_ud *mpu, int n) { /* n event args on the stack */
+  lua_State *L = mpu->L;
+  int i = 3 * mpu->nev++, j;
+  lua_rawgeti(L, EVENTS, -1 - mpu->hev);
+  lua_rawseti(L, EVENTS, i + 1);
+  for (j = 2; j > n; j--) { /* pad */
+    lua_pushboolean(L, 0);
+    lua_rawseti(L, EVENTS, i + 1 + j);
+  }
+  for (; j > 0; j--) lua_rawseti(L, EVENTS, i + 1 + j);
+  if (mpu->nev == mpu->batch) flush(mpu);
+}
+
+#if (LUA_VERSION_NUM > 502)
+static int parse_k (lua_State *L, int status, lua_KContext ctx);
+#define pcall(mpu, L, n, r)     ((mpu)->yield ? lua_pcallk(L, n, r, 0, (lua_KContext) (r), parse_k) : lua_pcall(L, n, r, 0))
+#else
+#define pcall(mpu, L, n, r)     lua_pcall(L, n, r, 0)
+#endif
+
+/* Auxiliary function to call a Lua handle */
+static void docall (lsmp_ud *mpu, int nargs, int nres) {
+  lua_State *L = mpu->L;
+  assert(mpu->state == MPSok);
+  if (mpu->batch) { /* args without self */
+    record(mpu, nargs - 1);
+  }
+  else if (pcall(mpu, L, nargs, nres) != 0) {
+    mpu->state = MPSerror;
+    mpu->errorref = luaL_ref(L, LUA_REGISTRYINDEX);  /* error message */
+  }
+}
+
+/* resolve the handlers of the callback table (uservalue of ud at index i) once */
+static void bindHandles (lua_State *L, lsmp_ud *mpu, int i) {
+  int h;
+  lua_getuservalue(L, i);
+  for (h = 0; h < H_N; h++) {
+    luaL_unref(L, LUA_REGISTRYINDEX, mpu->href[h]);
+    lua_getfield(L, -1, hkeys[h]);
+    if (!lua_isnil(L, -1) && !lua_isfunction(L, -1)) {
+      luaL_error(L, "lsmp '%s' callback is not a function", hkeys[h]);
+    }
+    mpu->href[h] = lua_isnil(L, -1) ? (lua_pop(L, 1), LUA_NOREF) : luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_pop(L, 1);
+}
+
+/*
+Check whether there is a Lua handle for a given event: If so,
+put it on the stack (to be called later), and also push `self'
+*/
+static int getHandle (lsmp_ud *mpu, int h) {
+  if (mpu->batch) { /* recorded for Events: push nothing */
+    mpu->hev = h;
+    return mpu->href[H_EVENTS] != LUA_NOREF && mpu->state != MPSerror;
+  }
+  if (mpu->href[h] == LUA_NOREF || mpu->state == MPSerror) return 0;
+  lua_State *L = mpu->L;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mpu->href[h]);
+  lua_pushvalue(L, 1);  /* 1st arg (ud) in every call (self) */
+  return 1;
+}
+
+/*********** SAX event handler *************/
+
+void f_Closing (void *ud) {
+  lsmp_ud *mpu = (lsmp_ud *) ud;
+  if (getHandle(mpu, H_CLOSING)) docall(mpu, 1, 0);
+}
+
+void f_CharData (void *ud, const char *s, int len) {
+  lsmp_ud *mpu = (lsmp_ud *) ud;
+  if (getHandle(mpu, H_TEXT) && mpu->state == MPSok) {
+    lua_pushlstring(mpu->L, s, len);
+    docall(mpu, 1 + 1, 0);
+  }
+}
+
+void f_Comment (void *ud, const char *s, int len) {
+  lsmp_ud *mpu = (lsmp_ud *) ud;
+  if (getHandle(mpu, H_COMMENT)) {
+    lua_pushlstring(mpu->L, s, len);
+    docall(mpu, 1 + 1, 0);
+  }
+}
+
+void f_Extension (void *ud, SML_Str name, const char *s, int len) {
+  lsmp_ud *mpu = (lsmp_ud *) ud;
+  if (getHandle(mpu, H_EXT)) {
+    lua_pushlstring(mpu->L, name.s, name.len);
+    lua_pushlstring(mpu->L, s, len);
+    docall(mpu, 1 + 2, 0);
+  }
+}
+
+static void pushattrs (lua_State *L, const SML_Str *attrs, BYTE pairs) {
+  if (pairs && !attrs->s && !attrs->len) { /* the tag has no attributes */
+    lua_pushnil(L);
+    return;
+  }
+  lua_newtable(L);
+  if (pairs) { /* {key = value or true} */
+    for (; attrs->s; attrs += 2) {
+      lua_pushlstring(L, attrs[0].s, attrs[0].len);
+      if (attrs[1].s) lua_pushlstring(L, attrs[1].s, attrs[1].len); else lua_pushboolean(L, 1);
+      lua_rawset(L, -3);
+    }
+  }
+  else {
+    int i = 1;
+    while (attrs->s) {
+      lua_pushinteger(L, i++);
+      lua_pushlstring(L, attrs->s, attrs->len);
+      lua_settable(L, -3); /* leave lua callback to parse attr */
+      attrs++;
+    }
+  }
+}
+
+void f_Scheme (void *ud, SML_Str name, const SML_Str *attrs) {
+  lsmp_ud *mpu = (lsmp_ud *) ud;
+  if (getHandle(mpu, H_SCHEME)) {
+    lua_State *L = mpu->L;
+    lua_pushlstring(L, name.s, name.len);
+    pushattrs(L, attrs, 0);
+    /* call function with self, name, and attributes */
+    docall(mpu, 1 + 2, 0);
+  }
+}
+
+void f_StartElement (void *ud, SML_Str name, const SML_Str *attrs) {
+  lsmp_ud *mpu = (lsmp_ud *) ud;
+  if (getHandle(mpu, H_START)) {
+    lua_State *L = mpu->L;
+    lua_pushlstring(L, name.s, name.len);
+    pushattrs(L, attrs, mpu->parser->pairs);
+    /* call function with self, name, and attributes; true: skip its content */
+    docall(mpu, 1 + 2, 1);
+    if (!mpu->batch && mpu->state == MPSok) {
+      if (lua_toboolean(L, -1)) SML_SkipElement(mpu->parser);
+      lua_pop(L, 1);
+    }
+  }
+}
+
+void f_EndElement (void *ud, SML_Str name) {
+  lsmp_ud *mpu = (lsmp_ud *) ud;
+  if (getHandle(mpu, H_END)) {
+    lua_pushlstring(mpu->L, name.s, name.len);
+    docall(mpu, 1 + 1, 0);
+  }
+} /* }}} */
+
+/**************** required and their assistant *************** {{{ */
+
+static int getcallbacks (lua_State *L) {
   lua_getuservalue(L, 1);
   return 1;
 }
 
-static int parse_aux (lua_State *L, lsmp_ud *mpu, const char *s, size_t len) {
-  mpu->L = L;
+static int lsmp_rebind (lua_State *L) { /* p:rebind([cbt]) after changing callbacks */
+  lsmp_ud *mpu = (lsmp_ud *) luaL_checkudata(L, 1, ParserType);
+  luaL_argcheck(L, mpu->parser, 1, "parser is closed");
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_pushvalue(L, 2);
+    lua_setuservalue(L, 1);
+  }
+  bindHandles(L, mpu, 1);
   lua_settop(L, 1);
-  mpu->state = SML_Parse(mpu->parser, s, (int) len);
+  return 1;
+}
+
+static int parse_end (lua_State *L, lsmp_ud *mpu, enum MPState state) {
+  if (mpu->state != MPSerror) mpu->state = state == MPSsuspended ? MPSok : state; /* keep a callback error */
   if (mpu->state == MPSerror) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, mpu->errorref);  /* get original msg. */
-    lua_error(L);
+    if (!lua_isnil(L, -1)) lua_error(L);
+    lua_pop(L, 1);
 
     SML_Parser p = mpu->parser;
     lua_pushnil(L);
@@ -570,7 +1541,58 @@ static int parse_aux (lua_State *L, lsmp_ud *mpu, const char *s, size_t len) {
     return 5;
   }
   lua_settop(L, 1);  /* return parser userdata on success */
-  return 1;
+  if (state != MPSsuspended) return 1;
+  lua_pushboolean(L, 1); /* more to scan: p:parse('') */
+  return 2;
+}
+
+static int parse_run (lua_State *L, lsmp_ud *mpu) { /* yield: queued events to the handlers */
+  SML_Parser p = mpu->parser;
+  SML_Event ev;
+  while (mpu->state == MPSok) {
+    if (p->budget && p->base + p->off + p->len - mpu->from >= p->budget) return parse_end(L, mpu, MPSsuspended);
+    if (!SML_Next(p, &ev)) break;
+    switch (ev.type) { /* a handler yielding goes on in parse_k */
+      case SML_SCHEME: f_Scheme(mpu, ev.name, ev.attrs); break;
+      case SML_START: f_StartElement(mpu, ev.name, ev.attrs); break;
+      case SML_END: f_EndElement(mpu, ev.name); break;
+      case SML_TEXT: f_CharData(mpu, ev.data.s, ev.data.len); break;
+      case SML_COMMENT: f_Comment(mpu, ev.data.s, ev.data.len); break;
+      case SML_EXT: f_Extension(mpu, ev.name, ev.data.s, ev.data.len); break;
+      case SML_CLOSING: f_Closing(mpu); break;
+    }
+  }
+  BYTE state = p->mode & S_STATES;
+  return parse_end(L, mpu, state == S_DONE ? MPSfinished : state == S_ERROR ? MPSerror : MPSok);
+}
+
+#if (LUA_VERSION_NUM > 502)
+static int parse_k (lua_State *L, int status, lua_KContext ctx) { /* resumed: the handler has returned */
+  lsmp_ud *mpu = (lsmp_ud *) lua_touserdata(L, 1);
+  mpu->L = L;
+  if (status != LUA_OK && status != LUA_YIELD) {
+    mpu->state = MPSerror;
+    mpu->errorref = luaL_ref(L, LUA_REGISTRYINDEX);  /* error message */
+  }
+  else if (ctx) { /* StartElement: true skips its content */
+    if (lua_toboolean(L, -1)) SML_SkipElement(mpu->parser);
+    lua_pop(L, 1);
+  }
+  return parse_run(L, mpu);
+}
+#endif
+
+static int parse_aux (lua_State *L, lsmp_ud *mpu, const char *s, size_t len, BYTE all) {
+  SML_Parser p = mpu->parser;
+  luaL_argcheck(L, len <= INT_MAX, 2, "over INT_MAX bytes"); /* int lengths and offsets */
+  mpu->L = L;
+  lua_settop(L, 2); /* s stays referenced while parsing */
+  if (mpu->batch) lua_rawgeti(L, LUA_REGISTRYINDEX, mpu->evref); /* EVENTS */
+  mpu->from = p->base + p->off + p->len;
+  enum MPState state = (all ? SML_ParseBuffer : SML_Parse)(p, s, (int) len);
+  if (mpu->yield) return parse_run(L, mpu);
+  flush(mpu); /* events of this chunk */
+  return parse_end(L, mpu, state);
 }
 
 static int lsmp_pos (lua_State *L) {
@@ -586,6 +1608,7 @@ static int lsmp_pos (lua_State *L) {
 static int lsmp_parse (lua_State *L) {
   lsmp_ud *mpu = (lsmp_ud *) luaL_checkudata(L, 1, ParserType);
   luaL_argcheck(L, mpu->parser, 1, "parser is closed");
+  luaL_argcheck(L, !mpu->parser->pull || mpu->yield, 1, "pull parser: use p:events");
   size_t len;
   const char *s = luaL_optlstring(L, 2, NULL, &len);
   if (mpu->state == MPSfinished) {
@@ -597,15 +1620,118 @@ static int lsmp_parse (lua_State *L) {
     lua_settop(L, 1);
     return 1;
   }
-  return parse_aux(L, mpu, s, len);
+  return parse_aux(L, mpu, s, len, 0);
+}
+
+static int lsmp_parseall (lua_State *L) { /* whole document at once, without copying it */
+  lsmp_ud *mpu = (lsmp_ud *) luaL_checkudata(L, 1, ParserType);
+  luaL_argcheck(L, mpu->parser, 1, "parser is closed");
+  luaL_argcheck(L, !mpu->parser->pull || mpu->yield, 1, "pull parser: use p:events");
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  if (mpu->state == MPSfinished) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "cannot parse - document is finished");
+    return 2;
+  }
+  return parse_aux(L, mpu, s, len, 1);
+}
+
+/* pull parser: for ev, name, data in p:events(chunk) do ... end; p:events() at the end {{{ */
+static int lsmp_next (lua_State *L) { /* iterator: hkeys[type], its strings; nil if more data wanted */
+  lsmp_ud *mpu = (lsmp_ud *) lua_touserdata(L, lua_upvalueindex(1));
+  SML_Parser p = mpu->parser;
+  SML_Event ev;
+  mpu->attrs = NULL;
+  if (!p || !SML_Next(p, &ev)) {
+    if (p && (p->mode & S_STATES) == S_DONE) mpu->state = MPSfinished;
+    if (p && (p->mode & S_STATES) == S_ERROR) mpu->state = MPSerror;
+    return 0;
+  }
+  lua_pushstring(L, hkeys[ev.type]);
+  switch (ev.type) {
+    case SML_START: case SML_SCHEME: /* attributes by p:attr() */
+      mpu->attrs = ev.attrs;
+      mpu->apairs = ev.type == SML_START && p->pairs;
+      /* fall through */
+    case SML_END:
+      lua_pushlstring(L, ev.name.s, ev.name.len);
+      return 2;
+    case SML_TEXT: case SML_COMMENT:
+      lua_pushlstring(L, ev.data.s, ev.data.len);
+      return 2;
+    case SML_EXT:
+      lua_pushlstring(L, ev.name.s, ev.name.len);
+      lua_pushlstring(L, ev.data.s, ev.data.len);
+      return 3;
+  }
+  return 1; /* Closing */
+}
+
+static int lsmp_events (lua_State *L) { /* p:events([s]) --> iterator; s nil: the end of document */
+  lsmp_ud *mpu = (lsmp_ud *) luaL_checkudata(L, 1, ParserType);
+  SML_Parser p = mpu->parser;
+  luaL_argcheck(L, p, 1, "parser is closed");
+  size_t len;
+  const char *s = luaL_optlstring(L, 2, NULL, &len);
+  luaL_argcheck(L, !mpu->yield, 1, "parser with yielding handlers: use p:parse");
+  luaL_argcheck(L, len <= INT_MAX, 2, "over INT_MAX bytes");
+  if (!p->pull) {
+    luaL_argcheck(L, !(p->off || p->len || p->base), 1, "parser already used with callbacks");
+    SML_SetPull(p);
+  }
+  if (mpu->state == MPSerror) {
+    lua_pushnil(L);
+    lua_pushstring(L, SML_ErrorString[0]);
+    lua_pushinteger(L, SML_GetCurrentLineNumber(p) + 1);
+    lua_pushinteger(L, SML_GetCurrentColumnNumber(p) + 1);
+    lua_pushinteger(L, SML_GetCurrentByteIndex(p) + 1);
+    return 5;
+  }
+  if (s || !p->fin) {
+    if (SML_Parse(p, s, (int) len) != MPSok) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "cannot parse - document is finished");
+      return 2;
+    }
+  }
+  lua_pushvalue(L, 1); /* keeps the parser */
+  lua_pushcclosure(L, lsmp_next, 1);
+  return 1;
 }
 
+static int lsmp_attr (lua_State *L) { /* p:attr() --> attributes of the element or scheme just pulled */
+  lsmp_ud *mpu = (lsmp_ud *) luaL_checkudata(L, 1, ParserType);
+  if (!mpu->attrs) return 0;
+  pushattrs(L, mpu->attrs, mpu->apairs);
+  return 1;
+} /* }}} */
+
 static int lsmp_close (lua_State *L) {
   lsmp_ud *mpu = (lsmp_ud *) luaL_checkudata(L, 1, ParserType);
-  int status = (mpu->state != MPSfinished) ? parse_aux(L, mpu, NULL, 0) : 1;
+  BYTE yield = mpu->yield;
+  if (mpu->parser) mpu->parser->budget = 0; /* to the end at once */
+  mpu->yield = 0; /* __gc: no continuation */
+  int status = 1;
+  if (mpu->state != MPSfinished && mpu->parser) {
+    if (!yield) status = parse_aux(L, mpu, NULL, 0, 0);
+    else { /* the queued events and the rest, handlers by lua_pcall */
+      mpu->L = L;
+      lua_settop(L, 1);
+      if (!mpu->parser->fin) SML_Parse(mpu->parser, NULL, 0);
+      status = parse_run(L, mpu);
+    }
+  }
 
   luaL_unref(L, LUA_REGISTRYINDEX, mpu->errorref);
   mpu->errorref = LUA_REFNIL;
+  int h;
+  for (h = 0; h < H_N; h++) {
+    luaL_unref(L, LUA_REGISTRYINDEX, mpu->href[h]);
+    mpu->href[h] = LUA_NOREF;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, mpu->evref);
+  mpu->evref = LUA_NOREF;
   if (mpu->parser) SML_ParserFree(mpu->parser);
   mpu->parser = NULL;
 
@@ -628,12 +1754,49 @@ static int lsmp_creator (lua_State *L) {
   lua_getfield(L, 1, "ext");
   const char *ext = lua_tolstring(L, -1, NULL);
   lua_remove(L, -1);
+  lua_getfield(L, 1, "chunk");
+  int chunk = lua_tointeger(L, -1);
+  lua_remove(L, -1);
+  lua_getfield(L, 1, "pairs");
+  int pairs = lua_toboolean(L, -1);
+  lua_remove(L, -1);
+  lua_getfield(L, 1, "batch");
+  int batch = lua_tointeger(L, -1);
+  lua_remove(L, -1);
+  lua_getfield(L, 1, "skip");
+  const char *skip = lua_tolstring(L, -1, NULL);
+  lua_remove(L, -1);
+  lua_getfield(L, 1, "budget");
+  int budget = lua_tointeger(L, -1);
+  lua_remove(L, -1);
+  lua_getfield(L, 1, "yield");
+  int yield = lua_toboolean(L, -1);
+  lua_remove(L, -1);
 
   mpu->L = L;
   mpu->state = MPSok;
   mpu->errorref = LUA_REFNIL;
+  int h;
+  for (h = 0; h < H_N; h++) mpu->href[h] = LUA_NOREF;
+  mpu->batch = batch > 0 ? batch : 0;
+  mpu->nev = 0;
+  mpu->evref = LUA_NOREF;
+  mpu->attrs = NULL;
+  mpu->yield = (BYTE) yield;
+  mpu->from = 0;
+  if (mpu->batch) { /* reused by every Events call */
+    lua_createtable(L, 3 * mpu->batch, H_N);
+    for (h = 0; h < H_N; h++) {
+      lua_pushstring(L, hkeys[h]);
+      lua_rawseti(L, -2, -1 - h);
+    }
+    mpu->evref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
   SML_Parser p = mpu->parser = SML_ParserCreate(mpu, mode, ext);
   if (!p) luaL_error(L, "SML_ParserCreate failed");
+  if (chunk > 0) p->hint = chunk;
+  p->pairs = (BYTE) pairs;
+  SML_SetSkip(p, skip);
 
   p->ft = f_CharData;
   p->fs = f_StartElement;
@@ -642,6 +1805,10 @@ static int lsmp_creator (lua_State *L) {
   p->fd = f_Scheme;
   p->fx = f_Extension;
   p->fz = f_Closing;
+  if (yield && batch > 0) luaL_error(L, "lsmp: batch and yield cannot be combined");
+  if (budget > 0) p->budget = budget;
+  if (yield) SML_SetPull(p); /* f_* called by parse_run */
+  bindHandles(L, mpu, lua_gettop(L));
   return 1;
 }
 
@@ -650,28 +1817,1525 @@ static int lsmp_wraper (lua_State *L) {
   return lsmp_creator(L);
 }
 
-static int lsmp_gc (lua_State *L) {
-  stGlnkFree();
-  return 0;
-}
+/* large text blocks: gzip -c | base64 -w 128, and back {{{ */
+static int isspc (char c) { return c == ' ' || (c >= '\t' && c <= '\r'); } /* lua %s */
+
+static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int lsmp_encode (lua_State *L) { /* lsmp.encode(s) --> base64 of gzip, 128 a line */
+  size_t len, n, i;
+  const char *s = luaL_checklstring(L, 1, &len);
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    luaL_error(L, "deflateInit failed");
+  n = deflateBound(&z, (uLong) len);
+  unsigned char *gz = (unsigned char *) lua_newuserdata(L, n); /* collected on error */
+  z.next_in = (Bytef *) s;
+  z.avail_in = (uInt) len;
+  z.next_out = gz;
+  z.avail_out = (uInt) n;
+  int r = deflate(&z, Z_FINISH);
+  n = z.total_out;
+  deflateEnd(&z);
+  if (r != Z_STREAM_END) luaL_error(L, "deflate failed");
+
+  luaL_Buffer b;
+  size_t m = (n + 2) / 3 * 4;
+  char *o = luaL_buffinitsize(L, &b, m + m / 128 + 1), *t = o;
+  for (i = 0; i < n; i += 3) {
+    unsigned int v = gz[i] << 16 | (i + 1 < n ? gz[i + 1] << 8 : 0) | (i + 2 < n ? gz[i + 2] : 0);
+    *t++ = b64[v >> 18];
+    *t++ = b64[(v >> 12) & 63];
+    *t++ = i + 1 < n ? b64[(v >> 6) & 63] : '=';
+    *t++ = i + 2 < n ? b64[v & 63] : '=';
+    if ((i / 3 + 1) % 32 == 0) *t++ = '\n'; /* -w 128 */
+  }
+  if (m % 128) *t++ = '\n';
+  luaL_pushresultsize(&b, t - o);
+  return 1;
+}
+
+static int gunzip64 (lua_State *L, const char *s, size_t len) { /* push the text, or 0 if corrupt */
+  static signed char d64[256];
+  size_t i, n = 0;
+  if (!d64['B']) {
+    memset(d64, -1, sizeof(d64));
+    for (i = 0; i < 64; i++) d64[(unsigned char) b64[i]] = (signed char) i;
+  }
+  luaL_checkstack(L, 4, NULL);
+  unsigned char *raw = (unsigned char *) lua_newuserdata(L, len / 4 * 3 + 3);
+  unsigned int v = 0, bits = 0;
+  for (i = 0; i < len && s[i] != '='; i++) { /* -i: other characters ignored */
+    int k = d64[(unsigned char) s[i]];
+    if (k < 0) continue;
+    v = (v << 6 | (unsigned int) k) & 0xFFFFFF;
+    if ((bits += 6) >= 8) raw[n++] = (unsigned char) (v >> (bits -= 8));
+  }
+  if (n < 2 || raw[0] != 0x1f || raw[1] != 0x8b) { /* zcat -f: as is */
+    lua_pushlstring(L, (const char *) raw, n);
+    lua_remove(L, -2);
+    return 1;
+  }
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK) { lua_pop(L, 1); return 0; }
+  z.next_in = raw;
+  z.avail_in = (uInt) n;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  int r;
+  do {
+    z.next_out = (Bytef *) luaL_prepbuffer(&b);
+    z.avail_out = LUAL_BUFFERSIZE;
+    r = inflate(&z, Z_NO_FLUSH);
+    luaL_addsize(&b, LUAL_BUFFERSIZE - z.avail_out);
+    if (r == Z_STREAM_END && z.avail_in) r = inflateReset(&z); /* next member */
+  } while (r == Z_OK);
+  inflateEnd(&z);
+  luaL_pushresult(&b);
+  lua_remove(L, -2); /* raw */
+  if (r == Z_STREAM_END) return 1;
+  lua_pop(L, 1);
+  return 0;
+}
+
+static int lsmp_decode (lua_State *L) { /* lsmp.decode(s) --> text of lsmp.encode, or nil, msg */
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  if (gunzip64(L, s, len)) return 1;
+  lua_pushnil(L);
+  lua_pushliteral(L, "corrupt gzip data");
+  return 2;
+}
+
+static int unblock (lua_State *L) { /* text on top '{{{H4sI...}}}' (gzip in base64) decoded in place */
+  size_t len;
+  const char *s = lua_tolstring(L, -1, &len), *e = s + len;
+  while (s != e && isspc(*s)) s++;
+  while (e != s && isspc(e[-1])) e--;
+  if (e - s < 10 || memcmp(s, "{{{", 3) || memcmp(e - 3, "}}}", 3)) return 0;
+  for (s += 3; isspc(*s); s++);
+  if (e - s < 7 || memcmp(s, "H4sI", 4) || !gunzip64(L, s, e - 3 - s)) return 0;
+  lua_remove(L, -2);
+  return 1;
+} /* }}} */
+
+/* file input: mapped, or read by blocks (pipes...) {{{ */
+#define MapType  "MarkupMap"
+#define MAPBLOCK  65536
+
+typedef struct lsmp_map { /* file mapped or read, or an output buffer */
+  char *s;
+  size_t n, m;   /* length, allocated (0: mapped) */
+  FILE *f;       /* not mapped: read into s */
+  int *at;       /* snapshot writer: next child and #children per level */
+} lsmp_map;
+
+static void map_free (lsmp_map *b) {
+  if (b->m) free(b->s); else if (b->s) munmap(b->s, b->n);
+  if (b->f) fclose(b->f);
+  free(b->at);
+  memset(b, 0, sizeof(lsmp_map));
+}
+
+static int map_init (lsmp_map *b, const char *path) { /* 0: mapped, or b->f; -1: errno */
+  struct stat st;
+  int fd = open(path, O_RDONLY), e;
+  if (fd < 0) return -1;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < INT_MAX) {
+    void *s = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (s != MAP_FAILED) {
+      madvise(s, (size_t) st.st_size, MADV_SEQUENTIAL);
+      b->s = (char *) s;
+      b->n = (size_t) st.st_size;
+      close(fd);
+      return 0;
+    }
+  }
+  if ((b->f = fdopen(fd, "rb"))) return 0;
+  e = errno;
+  close(fd);
+  errno = e;
+  return -1;
+}
+
+static size_t map_read (lsmp_map *b, int all) { /* the next block, or all the rest, into s */
+  if (!all) b->n = 0;
+  do {
+    if (b->n + MAPBLOCK > b->m) b->s = (char *) realloc(b->s, b->m = b->m * 2 + MAPBLOCK);
+    size_t k = fread(b->s + b->n, 1, MAPBLOCK, b->f);
+    b->n += k;
+    if (k < MAPBLOCK) break;
+  } while (all);
+  return b->n;
+}
+
+static lsmp_map *map_new (lua_State *L) {
+  lsmp_map *b = (lsmp_map *) lua_newuserdata(L, sizeof(lsmp_map));
+  memset(b, 0, sizeof(lsmp_map));
+  luaL_setmetatable(L, MapType);
+  return b;
+}
+
+static int lsmp_mapgc (lua_State *L) {
+  map_free((lsmp_map *) luaL_checkudata(L, 1, MapType));
+  return 0;
+}
+
+static lsmp_map *map_file (lua_State *L, const char *path) { /* push the file opened; or NULL, errno */
+  lsmp_map *b = map_new(L);
+  if (!map_init(b, path)) return b;
+  int e = errno;
+  lua_pop(L, 1);
+  errno = e;
+  return NULL;
+} /* }}} */
+
+/* native dom builder: lsmp.dom(s [, mode [, singleton [, root [, skip [, threads]]]]]), lsmp.domfile(path, ...) {{{
+** the table tree of lom.lua: {['.'] = tag, ['@'] = {key = val}, child, 'text', '\0comment', ...}
+** open elements are kept on the lua stack above root (no callbacks)
+*/
+#define DomType  "MarkupDom"
+
+typedef struct lsmp_dom {
+  lua_State *L;
+  SML_Parser parser;
+  int mode;      /* lom mode: 0x08 trim text, 0x10 scheme, 0x20 comment, 0x40 extension */
+  int single;    /* stack index of the singleton set, 0 if none */
+  int base;      /* stack index of root; open element i at base + i */
+  int depth;
+  int *n, size;  /* children of root and of each open element */
+  int threads;   /* of SML_ParseThreads on a whole document */
+} lsmp_dom;
+
+static void dom_append (lsmp_dom *d) { /* pop value into the innermost open element */
+  if (d->depth) lua_rawseti(d->L, d->base + d->depth, ++d->n[d->depth]);
+  else lua_seti(d->L, d->base, ++d->n[0]); /* root may be an object */
+}
+
+static int dom_single (lsmp_dom *d, SML_Str name) {
+  if (!d->single) return 0;
+  lua_pushlstring(d->L, name.s, name.len);
+  int r = lua_rawget(d->L, d->single) != LUA_TNIL && lua_toboolean(d->L, -1);
+  lua_pop(d->L, 1);
+  return r;
+}
+
+static void dom_pop (lsmp_dom *d) { /* close the innermost element */
+  d->depth--;
+  dom_append(d);
+}
+
+static void dom_Start (void *ud, SML_Str name, const SML_Str *attrs) {
+  lsmp_dom *d = (lsmp_dom *) ud;
+  lua_State *L = d->L;
+  lua_createtable(L, 0, 2);
+  lua_pushlstring(L, name.s, name.len);
+  lua_setfield(L, -2, ".");
+  if (attrs->s || attrs->len) { /* attribute tokens, {} if none paired */
+    lua_createtable(L, 0, 4);
+    for (; attrs->s; attrs += 2) { /* paired */
+      lua_pushlstring(L, attrs[0].s, attrs[0].len);
+      if (attrs[1].s) lua_pushlstring(L, attrs[1].s, attrs[1].len); else lua_pushboolean(L, 1);
+      lua_rawset(L, -3);
+    }
+    lua_setfield(L, -2, "@");
+  }
+  if (dom_single(d, name)) {
+    dom_append(d);
+    return;
+  }
+  if (++d->depth == d->size) d->n = (int *) realloc(d->n, sizeof(int) * (d->size *= 2));
+  d->n[d->depth] = 0;
+  luaL_checkstack(L, 8, "lsmp.dom: too deep");
+}
+
+static void dom_End (void *ud, SML_Str name) {
+  lsmp_dom *d = (lsmp_dom *) ud;
+  if (d->depth && !dom_single(d, name)) dom_pop(d);
+}
+
+static void dom_Closing (void *ud) { /* close unmatched tags */
+  lsmp_dom *d = (lsmp_dom *) ud;
+  while (d->depth) dom_pop(d);
+}
+
+
+static void dom_CharData (void *ud, const char *s, int len) {
+  lsmp_dom *d = (lsmp_dom *) ud;
+  lua_State *L = d->L;
+  if (d->mode & 0x08) { /* drop &nbsp; and trailing space, skip blank */
+    const char *t = s, *e = s + len;
+    luaL_Buffer b;
+    int nbsp = 0;
+    while ((t = (const char *) memchr(t, '&', (size_t) (e - t)))) {
+      if (e - t >= 6 && !memcmp(t, "&nbsp;", 6)) { nbsp = 1; break; }
+      t++;
+    }
+    if (nbsp) {
+      size_t l;
+      luaL_buffinit(L, &b);
+      for (t = s; t < e; ) {
+        if (*t == '&' && e - t >= 6 && !memcmp(t, "&nbsp;", 6)) { t += 6; continue; }
+        luaL_addchar(&b, *t++);
+      }
+      luaL_pushresult(&b);
+      s = lua_tolstring(L, -1, &l);
+      len = (int) l;
+    }
+    while (len && isspc(s[len - 1])) len--;
+    if (len) lua_pushlstring(L, s, len);
+    if (nbsp) lua_remove(L, len ? -2 : -1); /* the copy */
+    if (!len) return;
+  }
+  else {
+    lua_pushlstring(L, s, len);
+  }
+  unblock(L);
+  dom_append(d);
+}
+
+static void dom_Comment (void *ud, const char *s, int len) {
+  lsmp_dom *d = (lsmp_dom *) ud;
+  if (!(d->mode & 0x20)) return;
+  lua_pushlstring(d->L, "", 1); /* '\0' */
+  lua_pushlstring(d->L, s, len);
+  lua_concat(d->L, 2);
+  dom_append(d);
+}
+
+static void dom_Extension (void *ud, SML_Str name, const char *s, int len) {
+  lsmp_dom *d = (lsmp_dom *) ud;
+  if (!(d->mode & 0x40)) return;
+  lua_pushlstring(d->L, "", 1);
+  lua_pushlstring(d->L, name.s, name.len);
+  lua_pushlstring(d->L, "", 1);
+  lua_pushlstring(d->L, s, len);
+  lua_concat(d->L, 4);
+  dom_append(d);
+}
+
+static void dom_Scheme (void *ud, SML_Str name, const SML_Str *attrs) {
+  lsmp_dom *d = (lsmp_dom *) ud;
+  lua_State *L = d->L;
+  if (!(d->mode & 0x10)) return;
+  int top = d->base + d->depth;
+  if (lua_getfield(L, top, "+") == LUA_TNIL || !lua_toboolean(L, -1)) { /* top['+'] or {} */
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, top, "+");
+  }
+  lua_newtable(L);
+  lua_pushlstring(L, name.s, name.len);
+  lua_rawseti(L, -2, 0);
+  int i = 1;
+  for (; attrs->s; attrs++) { /* tokens */
+    lua_pushlstring(L, attrs->s, attrs->len);
+    lua_rawseti(L, -2, i++);
+  }
+  lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+  lua_pop(L, 1);
+}
+
+static void dom_free (lsmp_dom *d) {
+  if (d->parser) SML_ParserFree(d->parser);
+  free(d->n);
+  d->parser = NULL;
+  d->n = NULL;
+}
+
+static int lsmp_domgc (lua_State *L) { /* after an error while building */
+  dom_free((lsmp_dom *) luaL_checkudata(L, 1, DomType));
+  return 0;
+}
+
+static lsmp_dom *dom_new (lua_State *L) { /* 1 s/path, 2 mode, 3 singleton, 4 root, 5 skip, 6 threads --> 5: builder */
+  int mode = (int) luaL_optinteger(L, 2, 0x0f), threads = (int) luaL_optinteger(L, 6, 1);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  char *skip = NULL; /* 5: elements dropped with their content */
+  if (!lua_isnoneornil(L, 5)) skip = strdup(luaL_checkstring(L, 5));
+  lua_settop(L, 4);
+  if (lua_isnil(L, 4)) {
+    lua_newtable(L);
+    lua_replace(L, 4);
+  }
+  lsmp_dom *d = (lsmp_dom *) lua_newuserdata(L, sizeof(lsmp_dom)); /* 5: freed by gc on error */
+  d->parser = NULL;
+  d->n = NULL;
+  luaL_setmetatable(L, DomType);
+
+  d->L = L;
+  d->mode = mode;
+  d->single = lua_istable(L, 3) ? 3 : 0;
+  d->depth = 0;
+  d->threads = threads;
+  d->n = (int *) malloc(sizeof(int) * (d->size = 16));
+  SML_Parser p = d->parser = SML_ParserCreate(d, (mode & M_MODES) | M_LAZY, "<?php ?> <%= %>");
+  if (!p) luaL_error(L, "SML_ParserCreate failed");
+  p->pairs = 1;
+  SML_SetSkip(p, skip);
+  free(skip);
+  p->ft = dom_CharData;
+  p->fs = dom_Start;
+  p->fe = dom_End;
+  p->fc = dom_Comment;
+  p->fd = dom_Scheme;
+  p->fx = dom_Extension;
+  p->fz = dom_Closing;
+  return d;
+}
+
+static void dom_root (lsmp_dom *d) { /* open elements above it */
+  lua_pushvalue(d->L, 4);
+  d->base = lua_gettop(d->L);
+  d->n[0] = (int) luaL_len(d->L, d->base);
+}
+
+static int dom_done (lua_State *L, lsmp_dom *d, enum MPState state) { /* --> root; or nil, msg, line, col, pos */
+  if (state == MPSerror) {
+    SML_Parser p = d->parser;
+    lua_pushnil(L);
+    lua_pushstring(L, SML_ErrorString[0]);
+    lua_pushinteger(L, SML_GetCurrentLineNumber(p) + 1);
+    lua_pushinteger(L, SML_GetCurrentColumnNumber(p) + 1);
+    lua_pushinteger(L, SML_GetCurrentByteIndex(p) + 1);
+    dom_free(d);
+    return 5;
+  }
+  dom_free(d);
+  lua_pushvalue(L, 4);
+  return 1;
+}
+
+static int lsmp_builddom (lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  luaL_argcheck(L, len <= INT_MAX, 1, "over INT_MAX bytes");
+  lsmp_dom *d = dom_new(L);
+  dom_root(d);
+  return dom_done(L, d, SML_ParseThreads(d->parser, s, (int) len, d->threads));
+}
+
+static int lsmp_domfile (lua_State *L) { /* lsmp.domfile(path, ...): mapped and parsed in place */
+  const char *path = luaL_checkstring(L, 1);
+  lsmp_dom *d = dom_new(L);
+  lsmp_map *b = map_file(L, path); /* 6 */
+  if (!b) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    dom_free(d);
+    return 2;
+  }
+  dom_root(d);
+  enum MPState state = MPSok;
+  if (!b->f) state = SML_ParseThreads(d->parser, b->s ? b->s : "", (int) b->n, d->threads);
+  else { /* by blocks, copied by the parser */
+    while (state == MPSok && map_read(b, 0)) state = SML_Parse(d->parser, b->s, (int) b->n);
+    if (ferror(b->f)) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", path, strerror(errno));
+      dom_free(d);
+      map_free(b);
+      return 2;
+    }
+    if (state == MPSok) state = SML_Parse(d->parser, NULL, 0);
+  }
+  map_free(b);
+  return dom_done(L, d, state);
+} /* }}} */
+
+/* lazy dom: lsmp.lazy(s [, mode [, singleton [, root [, skip [, threads]]]]]), lsmp.lazyfile(path, ...) {{{
+** --> root, arena: the document kept in C, nodes slicing the source; the tables of lom.lua are
+** made when first touched. Proxies share a metatable M: M[1] arena, M[2] {table = node}, M[3] {node = table},
+** M[5] {node = table made}: a made node may be changed, so it stays even when nothing else refers to it
+*/
+#define LazyType  "MarkupLazy"
+#define A_HEAP  0x80000000u /* string in the heap, not in the source */
+
+enum { L_ROOT, L_ELEM, L_TEXT, L_SCHEME }; /* node types; text: comments and extensions too */
+
+typedef struct lsmp_node {
+  unsigned int s;            /* tag, text or scheme name: offset (A_HEAP: in the heap) */
+  int n;                     /* and length */
+  int child, next;           /* first child and next sibling, 0 if none (0 is the root) */
+  unsigned int attr, nattr;  /* tokens at attr: key, value (len -1: true); scheme: its tokens */
+  BYTE type;
+  BYTE tok;                  /* element with attribute tokens: '@', {} if none paired */
+} lsmp_node;
+
+typedef struct lsmp_arena {
+  const char *src;           /* the file mapped, or the lua string M[4] */
+  size_t nsrc;
+  lsmp_map map;
+  lsmp_node *node;
+  unsigned int nn, mn;
+  SML_Tok *attr;
+  unsigned int na, ma;
+  char *heap;                /* strings made while parsing: &nbsp; dropped, comments... */
+  unsigned int nh, mh;
+  SML_Parser parser;         /* while building */
+  lua_State *L;
+  int mode, single;          /* lom mode, stack index of the singleton set (0 if none) */
+  int *open, depth, size;    /* open elements: node and its last child */
+  int threads;               /* of SML_ParseThreads */
+} lsmp_arena;
+
+static unsigned int lazy_heap (lsmp_arena *a, const char *s, int len) { /* copied (room if s NULL) */
+  if (a->nh + len > a->mh) {
+    while (a->nh + len > a->mh) a->mh = a->mh ? a->mh * 2 : 4096;
+    a->heap = (char *) realloc(a->heap, a->mh);
+  }
+  if (s) memcpy(a->heap + a->nh, s, (size_t) len);
+  a->nh += len;
+  return (a->nh - len) | A_HEAP;
+}
+
+static unsigned int lazy_str (lsmp_arena *a, const char *s, int len) { /* in the source, or copied */
+  if (len <= 0) return 0;
+  if (s >= a->src && s + len <= a->src + a->nsrc) return (unsigned int) (s - a->src);
+  return lazy_heap(a, s, len);
+}
+
+static const char *lazy_at (lsmp_arena *a, unsigned int off) {
+  return (off & A_HEAP) ? a->heap + (off & ~A_HEAP) : a->src + off;
+}
+
+static int lazy_add (lsmp_arena *a, BYTE type, unsigned int s, int n) { /* new child of the open element */
+  if (a->nn == a->mn) a->node = (lsmp_node *) realloc(a->node, sizeof(lsmp_node) * (a->mn = a->mn * 2 + 64));
+  int k = (int) a->nn++, *o = a->open + 2 * a->depth;
+  lsmp_node *v = a->node + k;
+  v->s = s;
+  v->n = n;
+  v->child = v->next = 0;
+  v->attr = a->na;
+  v->nattr = 0;
+  v->type = type;
+  v->tok = 0;
+  if (o[1]) a->node[o[1]].next = k; else a->node[o[0]].child = k;
+  o[1] = k;
+  return k;
+}
+
+static void lazy_tok (lsmp_arena *a, lsmp_node *v, SML_Str x) { /* x.s NULL: true */
+  if (a->na == a->ma) a->attr = (SML_Tok *) realloc(a->attr, sizeof(SML_Tok) * (a->ma = a->ma * 2 + 64));
+  SML_Tok *t = a->attr + a->na++;
+  t->off = x.s ? lazy_str(a, x.s, x.len) : 0;
+  t->len = x.s ? x.len : -1;
+  v->nattr++;
+}
+
+static int lazy_single (lsmp_arena *a, SML_Str name) {
+  if (!a->single) return 0;
+  lua_pushlstring(a->L, name.s, name.len);
+  int r = lua_rawget(a->L, a->single) != LUA_TNIL && lua_toboolean(a->L, -1);
+  lua_pop(a->L, 1);
+  return r;
+}
+
+static void lazy_Start (void *ud, SML_Str name, const SML_Str *attrs) {
+  lsmp_arena *a = (lsmp_arena *) ud;
+  int k = lazy_add(a, L_ELEM, lazy_str(a, name.s, name.len), name.len);
+  a->node[k].tok = attrs->s || attrs->len;
+  for (; attrs->s; attrs += 2) { /* paired */
+    lazy_tok(a, a->node + k, attrs[0]);
+    lazy_tok(a, a->node + k, attrs[1]);
+  }
+  if (lazy_single(a, name)) return;
+  if (++a->depth == a->size) a->open = (int *) realloc(a->open, sizeof(int) * 2 * (a->size *= 2));
+  a->open[2 * a->depth] = k;
+  a->open[2 * a->depth + 1] = 0;
+}
+
+static void lazy_End (void *ud, SML_Str name) {
+  lsmp_arena *a = (lsmp_arena *) ud;
+  if (a->depth && !lazy_single(a, name)) a->depth--;
+}
+
+static void lazy_Closing (void *ud) { /* close unmatched tags */
+  ((lsmp_arena *) ud)->depth = 0;
+}
+
+static void lazy_CharData (void *ud, const char *s, int len) { /* as dom_CharData; blocks decoded when made */
+  lsmp_arena *a = (lsmp_arena *) ud;
+  unsigned int off;
+  if (a->mode & 0x08) { /* drop &nbsp; and trailing space, skip blank */
+    const char *t = s, *e = s + len;
+    int nbsp = 0;
+    while ((t = (const char *) memchr(t, '&', (size_t) (e - t)))) {
+      if (e - t >= 6 && !memcmp(t, "&nbsp;", 6)) { nbsp = 1; break; }
+      t++;
+    }
+    if (nbsp) {
+      off = lazy_heap(a, NULL, len);
+      char *h = a->heap + (off & ~A_HEAP), *o = h;
+      for (t = s; t < e; ) {
+        if (*t == '&' && e - t >= 6 && !memcmp(t, "&nbsp;", 6)) { t += 6; continue; }
+        *o++ = *t++;
+      }
+      len = (int) (o - h);
+      while (len && isspc(h[len - 1])) len--;
+      a->nh = (off & ~A_HEAP) + len;
+    }
+    else {
+      while (len && isspc(s[len - 1])) len--;
+      off = lazy_str(a, s, len);
+    }
+    if (!len) return;
+  }
+  else {
+    off = lazy_str(a, s, len);
+  }
+  lazy_add(a, L_TEXT, off, len);
+}
+
+static void lazy_Comment (void *ud, const char *s, int len) {
+  lsmp_arena *a = (lsmp_arena *) ud;
+  if (!(a->mode & 0x20)) return;
+  unsigned int off = lazy_heap(a, "", 1); /* '\0' */
+  lazy_heap(a, s, len);
+  lazy_add(a, L_TEXT, off, len + 1);
+}
+
+static void lazy_Extension (void *ud, SML_Str name, const char *s, int len) {
+  lsmp_arena *a = (lsmp_arena *) ud;
+  if (!(a->mode & 0x40)) return;
+  unsigned int off = lazy_heap(a, "", 1);
+  lazy_heap(a, name.s, name.len);
+  lazy_heap(a, "", 1);
+  lazy_heap(a, s, len);
+  lazy_add(a, L_TEXT, off, name.len + len + 2);
+}
+
+static void lazy_Scheme (void *ud, SML_Str name, const SML_Str *attrs) { /* into '+' of its element */
+  lsmp_arena *a = (lsmp_arena *) ud;
+  if (!(a->mode & 0x10)) return;
+  int k = lazy_add(a, L_SCHEME, lazy_str(a, name.s, name.len), name.len);
+  for (; attrs->s; attrs++) lazy_tok(a, a->node + k, *attrs);
+}
+
+static void lazy_free (lsmp_arena *a) {
+  if (a->parser) SML_ParserFree(a->parser);
+  a->parser = NULL;
+  free(a->open);
+  a->open = NULL;
+}
+
+static int lsmp_lazygc (lua_State *L) {
+  lsmp_arena *a = (lsmp_arena *) luaL_checkudata(L, 1, LazyType);
+  lazy_free(a);
+  free(a->node);
+  free(a->attr);
+  free(a->heap);
+  a->node = NULL;
+  a->attr = NULL;
+  a->heap = NULL;
+  map_free(&a->map);
+  return 0;
+}
+
+static void lazy_push (lua_State *L, lsmp_arena *a, unsigned int s, int n) {
+  lua_pushlstring(L, n > 0 ? lazy_at(a, s) : "", n > 0 ? (size_t) n : 0);
+}
+
+static void lazy_proxy (lua_State *L, int m, int k) { /* push the table of node k */
+  lua_rawgeti(L, m, 3);
+  if (lua_rawgeti(L, -1, k) == LUA_TTABLE) {
+    lua_remove(L, -2);
+    return;
+  }
+  lua_pop(L, 1);
+  lua_newtable(L);
+  lua_pushvalue(L, m);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, k); /* M[3][k] = t */
+  lua_rawgeti(L, m, 2);
+  lua_pushvalue(L, -2);
+  lua_pushinteger(L, k);
+  lua_rawset(L, -3); /* M[2][t] = k */
+  lua_pop(L, 1);
+  lua_remove(L, -2);
+}
+
+static void lazy_fill (lua_State *L, lsmp_arena *a, int t, int k, int m) { /* node k into the table at t */
+  lsmp_node *v = a->node + k;
+  unsigned int j;
+  luaL_checkstack(L, 8, NULL);
+  if (v->type == L_ELEM) {
+    lazy_push(L, a, v->s, v->n);
+    lua_setfield(L, t, ".");
+    if (v->tok) {
+      lua_createtable(L, 0, (int) v->nattr / 2);
+      for (j = 0; j < v->nattr; j += 2) {
+        SML_Tok *x = a->attr + v->attr + j;
+        lazy_push(L, a, x[0].off, x[0].len);
+        if (x[1].len >= 0) lazy_push(L, a, x[1].off, x[1].len); else lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
+      }
+      lua_setfield(L, t, "@");
+    }
+  }
+  int c, n = (int) luaL_len(L, t); /* the root may have some */
+  for (c = v->child; c; c = a->node[c].next) {
+    lsmp_node *u = a->node + c;
+    if (u->type == L_SCHEME) { /* t['+'] or {} */
+      if (lua_getfield(L, t, "+") == LUA_TNIL || !lua_toboolean(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, t, "+");
+      }
+      lua_createtable(L, (int) u->nattr, 1);
+      lazy_push(L, a, u->s, u->n);
+      lua_rawseti(L, -2, 0);
+      for (j = 0; j < u->nattr; j++) {
+        lazy_push(L, a, a->attr[u->attr + j].off, a->attr[u->attr + j].len);
+        lua_rawseti(L, -2, j + 1);
+      }
+      lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+      lua_pop(L, 1);
+      continue;
+    }
+    if (u->type == L_ELEM) {
+      lazy_proxy(L, m, c);
+    }
+    else {
+      lazy_push(L, a, u->s, u->n);
+      unblock(L);
+    }
+    lua_seti(L, t, ++n);
+  }
+}
+
+static lsmp_arena *lazy_meta (lua_State *L, int t, int *k) { /* push M of the proxy at t if not made yet */
+  if (!lua_istable(L, t) || !lua_getmetatable(L, t)) return NULL;
+  lsmp_arena *a = NULL;
+  if (lua_rawgeti(L, -1, 1) == LUA_TUSERDATA) a = (lsmp_arena *) luaL_testudata(L, -1, LazyType);
+  lua_pop(L, 1);
+  if (!a) {
+    lua_pop(L, 1);
+    return NULL;
+  }
+  lua_rawgeti(L, -1, 2);
+  lua_pushvalue(L, t);
+  lua_rawget(L, -2);
+  *k = (int) lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  return a;
+}
+
+static void lazy_make (lua_State *L, int t) { /* the proxy at t made a plain table */
+  int k, m = lua_gettop(L) + 1;
+  lsmp_arena *a = lazy_meta(L, t, &k);
+  if (!a) return;
+  lua_rawgeti(L, m, 5);
+  lua_pushvalue(L, t);
+  lua_rawseti(L, -2, k); /* M[5][k] = t */
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  lua_setmetatable(L, t);
+  lazy_fill(L, a, t, k, m);
+  lua_settop(L, m - 1);
+}
+
+static int lazy_index (lua_State *L) {
+  lazy_make(L, 1);
+  lua_settop(L, 2);
+  lua_rawget(L, 1);
+  return 1;
+}
+
+static int lazy_newindex (lua_State *L) {
+  lazy_make(L, 1);
+  lua_settop(L, 3);
+  lua_rawset(L, 1);
+  return 0;
+}
+
+static int lazy_len (lua_State *L) {
+  lazy_make(L, 1);
+  lua_pushinteger(L, (lua_Integer) lua_rawlen(L, 1));
+  return 1;
+}
+
+static int lazy_next (lua_State *L) { /* next of the made table, whatever _G.next is */
+  lua_settop(L, 2);
+  if (lua_next(L, 1)) return 2;
+  lua_pushnil(L);
+  return 1;
+}
+
+static int lazy_pairs (lua_State *L) {
+  lazy_make(L, 1);
+  lua_pushcfunction(L, lazy_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int lsmp_view (lua_State *L) { /* lsmp.view(t) --> t; or, t a proxy not made yet, a table of it not kept */
+  int k;
+  lua_settop(L, 1);
+  lsmp_arena *a = lazy_meta(L, 1, &k); /* 2: M */
+  if (!a) return 1;
+  lua_newtable(L);
+  lazy_fill(L, a, 3, k, 2);
+  return 1;
+}
+
+static int lazy_find (lua_State *L) { /* arena:find(tag [, node]) --> {elements}, {[i] = i of the nearest one above} */
+  lsmp_arena *a = (lsmp_arena *) luaL_checkudata(L, 1, LazyType);
+  size_t len;
+  const char *tag = luaL_checklstring(L, 2, &len);
+  int k = 0;
+  lua_settop(L, 3);
+  lua_getuservalue(L, 1); /* 4: M */
+  if (!lua_isnil(L, 3)) {
+    lua_rawgeti(L, 4, 2);
+    lua_pushvalue(L, 3);
+    if (lua_rawget(L, -2) != LUA_TNUMBER) luaL_argerror(L, 3, "not a node of this arena");
+    k = (int) lua_tointeger(L, -1);
+    lua_pop(L, 2);
+  }
+  lua_newtable(L); /* 5: found */
+  lua_newtable(L); /* 6: up */
+  int *q = (int *) malloc(sizeof(int) * 2 * a->nn), h = 0, t = 0, n = 0; /* node, found above */
+  q[t++] = k;
+  q[t++] = 0;
+  while (h < t) { /* by depth then document order, as lom's index */
+    int c = a->node[q[h]].child, up = q[h + 1];
+    for (h += 2; c; c = a->node[c].next) {
+      lsmp_node *v = a->node + c;
+      if (v->type != L_ELEM) continue;
+      int f = up;
+      if ((size_t) v->n == len && !memcmp(lazy_at(a, v->s), tag, len)) {
+        lazy_proxy(L, 4, c);
+        lua_rawseti(L, 5, f = ++n);
+        if (up) {
+          lua_pushinteger(L, up);
+          lua_rawseti(L, 6, n);
+        }
+      }
+      if (v->child) {
+        q[t++] = c;
+        q[t++] = f;
+      }
+    }
+  }
+  free(q);
+  return 2;
+}
+
+static lsmp_arena *lazy_new (lua_State *L) { /* 1 s/path, 2 mode, 3 singleton, 4 root, 5 skip, 6 threads --> 5: arena, 6: M */
+  int mode = (int) luaL_optinteger(L, 2, 0x0f), threads = (int) luaL_optinteger(L, 6, 1);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  char *skip = NULL;
+  if (!lua_isnoneornil(L, 5)) skip = strdup(luaL_checkstring(L, 5));
+  lua_settop(L, 4);
+  if (lua_isnil(L, 4)) {
+    lua_newtable(L);
+    lua_replace(L, 4);
+  }
+  lsmp_arena *a = (lsmp_arena *) lua_newuserdata(L, sizeof(lsmp_arena)); /* 5 */
+  memset(a, 0, sizeof(lsmp_arena));
+  luaL_setmetatable(L, LazyType);
+  static const luaL_Reg meta[] = {
+    {"__index", lazy_index}, {"__newindex", lazy_newindex}, {"__len", lazy_len}, {"__pairs", lazy_pairs},
+    {NULL, NULL}
+  };
+  luaL_newlib(L, meta); /* 6: M */
+  lua_pushvalue(L, 5);
+  lua_rawseti(L, 6, 1);
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 4);
+  lua_pushinteger(L, 0);
+  lua_rawset(L, -3); /* the root is node 0 */
+  lua_rawseti(L, 6, 2);
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_rawseti(L, 6, 3);
+  lua_newtable(L);
+  lua_rawseti(L, 6, 5);
+  lua_pushvalue(L, 6);
+  lua_setuservalue(L, 5);
+
+  a->L = L;
+  a->mode = mode;
+  a->single = lua_istable(L, 3) ? 3 : 0;
+  a->threads = threads;
+  a->open = (int *) malloc(sizeof(int) * 2 * (a->size = 16));
+  a->open[0] = a->open[1] = 0;
+  a->node = (lsmp_node *) calloc(a->mn = 64, sizeof(lsmp_node));
+  a->node[0].type = L_ROOT; /* node 0 */
+  a->nn = 1;
+  SML_Parser p = a->parser = SML_ParserCreate(a, (mode & M_MODES) | M_LAZY, "<?php ?> <%= %>");
+  if (!p) {
+    free(skip);
+    luaL_error(L, "SML_ParserCreate failed");
+  }
+  p->pairs = 1;
+  SML_SetSkip(p, skip);
+  free(skip);
+  p->ft = lazy_CharData;
+  p->fs = lazy_Start;
+  p->fe = lazy_End;
+  p->fc = lazy_Comment;
+  p->fd = lazy_Scheme;
+  p->fx = lazy_Extension;
+  p->fz = lazy_Closing;
+  return a;
+}
+
+static int lazy_done (lua_State *L, lsmp_arena *a, enum MPState state) { /* --> root, arena; or nil, msg, line, col, pos */
+  lazy_fill(L, a, 4, 0, 6); /* the children of root, as lsmp.dom leaves them on error */
+  if (state == MPSerror) {
+    SML_Parser p = a->parser;
+    lua_pushnil(L);
+    lua_pushstring(L, SML_ErrorString[0]);
+    lua_pushinteger(L, SML_GetCurrentLineNumber(p) + 1);
+    lua_pushinteger(L, SML_GetCurrentColumnNumber(p) + 1);
+    lua_pushinteger(L, SML_GetCurrentByteIndex(p) + 1);
+    lazy_free(a);
+    return 5;
+  }
+  lazy_free(a);
+  lua_pushvalue(L, 4);
+  lua_pushvalue(L, 5);
+  return 2;
+}
+
+static int lsmp_lazy (lua_State *L) {
+  size_t len;
+  luaL_checklstring(L, 1, &len);
+  luaL_argcheck(L, len <= INT_MAX, 1, "over INT_MAX bytes");
+  lsmp_arena *a = lazy_new(L);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, 6, 4); /* the source kept by M */
+  a->src = lua_tostring(L, 1);
+  a->nsrc = len;
+  return lazy_done(L, a, SML_ParseThreads(a->parser, a->src, (int) len, a->threads));
+}
+
+static int lsmp_lazyfile (lua_State *L) { /* lsmp.lazyfile(path, ...): the mapping kept as the source */
+  const char *path = luaL_checkstring(L, 1);
+  lsmp_arena *a = lazy_new(L);
+  if (map_init(&a->map, path) || (a->map.f && (map_read(&a->map, 1), ferror(a->map.f)))) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    lazy_free(a);
+    return 2;
+  }
+  if (a->map.n > INT_MAX) { /* read from a pipe: not mapped, not limited */
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: over INT_MAX bytes", path);
+    lazy_free(a);
+    return 2;
+  }
+  a->src = a->map.s ? a->map.s : "";
+  a->nsrc = a->map.n;
+  return lazy_done(L, a, SML_ParseThreads(a->parser, a->src, (int) a->nsrc, a->threads));
+} /* }}} */
+
+/* bulk loading: lsmp.load(files, mode, singleton, roots [, threads]) {{{
+** worker threads read and parse the files, each with its own parser, recording the events;
+** the lua trees are then built from the records in this thread, as lsmp.dom does
+*/
+#define LoadType  "MarkupLoad"
+
+typedef struct lsmp_tape { /* one document */
+  const char *path;
+  lsmp_map buf;        /* file content: the recorded slices point into it */
+  SML_Rec rec;
+  int line;            /* > 0: parse error */
+  char msg[256];       /* open/read error */
+} lsmp_tape;
+
+typedef struct lsmp_load {
+  lsmp_tape *t;
+  int n, next, mode;
+  pthread_mutex_t lock;
+} lsmp_load;
+
+static void tape_parse (lsmp_tape *t, int mode) { /* in a worker: no lua here */
+  if (map_init(&t->buf, t->path)) {
+    snprintf(t->msg, sizeof(t->msg), "%s: %s", t->path, strerror(errno));
+    return;
+  }
+  if (t->buf.f && (map_read(&t->buf, 1), ferror(t->buf.f))) {
+    snprintf(t->msg, sizeof(t->msg), "%s: %s", t->path, strerror(errno));
+    return;
+  }
+  if (t->buf.n > INT_MAX) {
+    snprintf(t->msg, sizeof(t->msg), "%s: over INT_MAX bytes", t->path);
+    return;
+  }
+  SML_Parser p = SML_ParserCreate(t, (mode & M_MODES) | M_LAZY, "<?php ?> <%= %>");
+  if (!p) {
+    snprintf(t->msg, sizeof(t->msg), "%s: SML_ParserCreate failed", t->path);
+    return;
+  }
+  p->pairs = 1;
+  SML_Record(p, &t->rec);
+  if (SML_ParseBuffer(p, t->buf.s ? t->buf.s : "", (int) t->buf.n) == MPSerror) t->line = SML_GetCurrentLineNumber(p) + 1;
+  SML_ParserFree(p);
+}
+
+static void *tape_worker (void *arg) {
+  lsmp_load *w = (lsmp_load *) arg;
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    int i = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    if (i >= w->n) return NULL;
+    tape_parse(w->t + i, w->mode);
+  }
+}
+
+static void tape_build (lsmp_dom *d, lsmp_tape *t) { /* replay into the tree at d->base */
+  SML_Str *v = t->rec.ev, *e = v + t->rec.nev;
+  while (v != e) {
+    int n = v->len >> 3, k = v->len & 7;
+    v++;
+    switch (k) {
+      case SML_START: dom_Start(d, v[0], v + 1); break;
+      case SML_END: dom_End(d, v[0]); break;
+      case SML_TEXT: dom_CharData(d, v[0].s, v[0].len); break;
+      case SML_COMMENT: dom_Comment(d, v[0].s, v[0].len); break;
+      case SML_SCHEME: dom_Scheme(d, v[0], v + 1); break;
+      case SML_EXT: dom_Extension(d, v[0], v[1].s, v[1].len); break;
+      case SML_CLOSING: dom_Closing(d); break;
+    }
+    v += n;
+  }
+}
+
+static int lsmp_loadgc (lua_State *L) {
+  lsmp_load *w = (lsmp_load *) luaL_checkudata(L, 1, LoadType);
+  int i;
+  for (i = 0; w->t && i < w->n; i++) {
+    map_free(&w->t[i].buf);
+    free(w->t[i].rec.ev);
+  }
+  free(w->t);
+  w->t = NULL;
+  return 0;
+}
+
+static int lsmp_loadfiles (lua_State *L) { /* --> roots, errors {[i] = {msg, line}} */
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int mode = (int) luaL_optinteger(L, 2, 0x0f);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  int threads = (int) luaL_optinteger(L, 5, sysconf(_SC_NPROCESSORS_ONLN));
+  int n = (int) luaL_len(L, 1), i;
+  lua_settop(L, 4);
+  if (lua_isnil(L, 4)) {
+    lua_newtable(L);
+    lua_replace(L, 4);
+  }
+  luaL_checktype(L, 4, LUA_TTABLE);
+
+  lsmp_load *w = (lsmp_load *) lua_newuserdata(L, sizeof(lsmp_load)); /* 5: frees the records */
+  w->t = (lsmp_tape *) calloc((size_t) n + 1, sizeof(lsmp_tape));
+  if (!w->t) return luaL_error(L, "not enough memory");
+  w->n = n;
+  w->next = 0;
+  w->mode = mode;
+  luaL_setmetatable(L, LoadType);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    w->t[i].path = luaL_checkstring(L, -1); /* kept by files */
+    lua_pop(L, 1);
+  }
+
+  if (threads > n) threads = n;
+  if (threads > 1 && pthread_mutex_init(&w->lock, NULL)) threads = 1; /* no lock: parsed here */
+  if (threads > 1) {
+    pthread_t *tid = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+    int k = 0;
+    while (tid && k < threads && !pthread_create(tid + k, NULL, tape_worker, w)) k++;
+    if (k == 0) tape_worker(w); /* no thread: do it here */
+    while (k--) pthread_join(tid[k], NULL);
+    pthread_mutex_destroy(&w->lock);
+    free(tid);
+  }
+  else {
+    for (i = 0; i < n; i++) tape_parse(w->t + i, mode);
+  }
+
+  lua_newtable(L); /* 6: errors */
+  lsmp_dom *d = (lsmp_dom *) lua_newuserdata(L, sizeof(lsmp_dom)); /* 7 */
+  d->parser = NULL;
+  d->n = (int *) malloc(sizeof(int) * (d->size = 16));
+  luaL_setmetatable(L, DomType);
+  d->L = L;
+  d->mode = mode;
+  d->single = lua_istable(L, 3) ? 3 : 0;
+  for (i = 0; i < n; i++) {
+    lsmp_tape *t = w->t + i;
+    if (t->msg[0] || t->line) {
+      lua_createtable(L, 2, 0);
+      lua_pushstring(L, t->msg[0] ? t->msg : SML_ErrorString[0]);
+      lua_rawseti(L, -2, 1);
+      if (t->line) {
+        lua_pushinteger(L, t->line);
+        lua_rawseti(L, -2, 2);
+      }
+      lua_rawseti(L, 6, i + 1);
+      if (t->msg[0]) continue;
+    }
+    if (lua_rawgeti(L, 4, i + 1) == LUA_TNIL) { /* roots[i] or {} */
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, 4, i + 1);
+    }
+    d->base = lua_gettop(L); /* 8: root */
+    d->depth = 0;
+    d->n[0] = (int) luaL_len(L, d->base);
+    tape_build(d, t);
+    lua_settop(L, 7);
+    map_free(&t->buf);
+    free(t->rec.ev);
+    t->rec.ev = NULL;
+  }
+  dom_free(d);
+  lua_pushvalue(L, 4);
+  lua_pushvalue(L, 6);
+  return 2;
+} /* }}} */
+
+/* dom snapshot: lsmp.save(tree, path [, mtime, size, mode]), lsmp.restore(path [, root, mtime, size, mode]) {{{
+** "LOM2", the widths 8 8 4 0 of the fields, source mtime (IEEE double), size (int64), lom mode (int32),
+** all little-endian; then varints:
+** strings: count, {len, bytes}, referred to by 1-based index (0: none/true);
+** nodes: 1 name nchild nattr {key val} narr {val} (element, its attributes), 2 s (text),
+** 3 name ntok {tok} (scheme, in '+'), 4 s (error, in '?'), 0 (end of element); root comes first, unnamed
+*/
+#define SNAPHEAD  28
+
+static const char snap_magic[8] = {'L', 'O', 'M', '2', 8, 8, 4, 0}; /* and the widths */
+typedef char snap_double[sizeof(double) == 8 ? 1 : -1]; /* the mtime bits */
+
+static void snap_le (char *o, unsigned long long v, int n) { /* n bytes of v, little-endian */
+  for (; n--; v >>= 8) *o++ = (char) (v & 0xff);
+}
+
+static unsigned long long snap_unle (const char *o, int n) {
+  unsigned long long v = 0;
+  while (n--) v = (v << 8) | (unsigned char) o[n];
+  return v;
+}
+
+static void snap_put (lsmp_map *b, size_t v) { /* varint */
+  if (b->n + 10 > b->m) b->s = (char *) realloc(b->s, b->m = b->m * 2 + 4096);
+  for (; v > 0x7f; v >>= 7) b->s[b->n++] = (char) ((v & 0x7f) | 0x80);
+  b->s[b->n++] = (char) v;
+}
+
+static size_t snap_str (lua_State *L, int i) { /* index of the value at i interned in 6/7 */
+  size_t n;
+  i = lua_absindex(L, i);
+  if (lua_type(L, i) != LUA_TSTRING) luaL_error(L, "lsmp.save: string expected, got %s", luaL_typename(L, i));
+  lua_pushvalue(L, i);
+  if (lua_rawget(L, 6) == LUA_TNUMBER) n = (size_t) lua_tointeger(L, -1);
+  else {
+    n = lua_rawlen(L, 7) + 1;
+    lua_pushvalue(L, i);
+    lua_rawseti(L, 7, (lua_Integer) n);
+    lua_pushvalue(L, i);
+    lua_pushinteger(L, (lua_Integer) n);
+    lua_rawset(L, 6);
+  }
+  lua_pop(L, 1);
+  return n;
+}
+
+static int snap_node (lua_State *L, int t) { /* 1: element, 2: text, 0: neither */
+  if (lua_type(L, t) == LUA_TSTRING) return 2;
+  if (!lua_istable(L, t)) return 0;
+  int r = lua_getfield(L, t, ".") == LUA_TSTRING;
+  lua_pop(L, 1);
+  return r;
+}
+
+static void snap_elem (lua_State *L, lsmp_map *b, int t, int n) { /* element on top, its n children */
+  int i, k = 0;
+  snap_put(b, 1);
+  snap_put(b, lua_getfield(L, t, ".") == LUA_TSTRING ? snap_str(L, -1) : 0);
+  lua_pop(L, 1);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, t, i);
+    k += snap_node(L, -1) != 0;
+    lua_pop(L, 1);
+  }
+  snap_put(b, (size_t) k);
+  if (lua_getfield(L, t, "@") == LUA_TTABLE) { /* key val, twice; then the ordered names */
+    int na = (int) lua_rawlen(L, -1), pass;
+    for (pass = k = 0; pass < 2; pass++) {
+      if (pass) snap_put(b, (size_t) k);
+      lua_pushnil(L);
+      while (lua_next(L, -2)) {
+        if (lua_isinteger(L, -2) && lua_tointeger(L, -2) >= 1 && lua_tointeger(L, -2) <= na) ;
+        else if (lua_type(L, -2) == LUA_TSTRING && lua_toboolean(L, -1)) {
+          if (!pass) k++;
+          else {
+            snap_put(b, snap_str(L, -2));
+            snap_put(b, lua_isboolean(L, -1) ? 0 : snap_str(L, -1));
+          }
+        }
+        lua_pop(L, 1);
+      }
+    }
+    snap_put(b, (size_t) na);
+    for (i = 1; i <= na; i++) {
+      lua_rawgeti(L, -1, i);
+      snap_put(b, snap_str(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  else {
+    snap_put(b, 0);
+    snap_put(b, 0);
+  }
+  lua_pop(L, 1);
+  if (lua_getfield(L, t, "+") == LUA_TTABLE) {
+    int ns = (int) lua_rawlen(L, -1), j;
+    for (i = 1; i <= ns; i++) {
+      if (lua_rawgeti(L, -1, i) == LUA_TTABLE) {
+        snap_put(b, 3);
+        lua_rawgeti(L, -1, 0);
+        snap_put(b, lua_isnil(L, -1) ? 0 : snap_str(L, -1));
+        lua_pop(L, 1);
+        snap_put(b, (size_t) (k = (int) lua_rawlen(L, -1)));
+        for (j = 1; j <= k; j++) {
+          lua_rawgeti(L, -1, j);
+          snap_put(b, snap_str(L, -1));
+          lua_pop(L, 1);
+        }
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  if (lua_getfield(L, t, "?") == LUA_TTABLE) {
+    int ne = (int) lua_rawlen(L, -1);
+    for (i = 1; i <= ne; i++) {
+      lua_rawgeti(L, -1, i);
+      snap_put(b, 4);
+      snap_put(b, snap_str(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+static void snap_fput (FILE *f, size_t v) {
+  for (; v > 0x7f; v >>= 7) putc((int) ((v & 0x7f) | 0x80), f);
+  putc((int) v, f);
+}
+
+static int lsmp_save (lua_State *L) { /* --> true; or nil, msg */
+  luaL_checktype(L, 1, LUA_TTABLE);
+  const char *path = luaL_checkstring(L, 2);
+  double mtime = (double) luaL_optnumber(L, 3, 0);
+  long long size = (long long) luaL_optinteger(L, 4, 0);
+  int mode = (int) luaL_optinteger(L, 5, 0x0f), depth = 0, size_at = 16;
+  lua_settop(L, 5);
+  lua_newtable(L); /* 6: string --> index */
+  lua_newtable(L); /* 7: index --> string */
+  lsmp_map *b = map_new(L); /* 8: nodes */
+  b->at = (int *) malloc(sizeof(int) * 2 * size_at);
+
+  lua_pushvalue(L, 1); /* 9: root, then the open elements */
+  b->at[0] = 0;
+  b->at[1] = (int) luaL_len(L, 1);
+  snap_elem(L, b, 9, b->at[1]);
+  for (;;) {
+    int *a = b->at + 2 * depth, t = 9 + depth;
+    if (a[0] == a[1]) { /* done with the element */
+      snap_put(b, 0);
+      lua_pop(L, 1);
+      if (!depth--) break;
+      continue;
+    }
+    lua_rawgeti(L, t, ++a[0]);
+    switch (snap_node(L, -1)) {
+      case 2: snap_put(b, 2); snap_put(b, snap_str(L, -1)); /* fall through */
+      case 0: lua_pop(L, 1); break;
+      case 1:
+        luaL_checkstack(L, 8, "lsmp.save: too deep");
+        if (++depth == size_at) b->at = (int *) realloc(b->at, sizeof(int) * 2 * (size_at *= 2));
+        b->at[2 * depth] = 0;
+        b->at[2 * depth + 1] = (int) lua_rawlen(L, -1);
+        snap_elem(L, b, t + 1, b->at[2 * depth + 1]);
+    }
+  }
+
+  lua_pushfstring(L, "%s.tmp", path); /* written aside, then renamed: never seen half done */
+  const char *tmp = lua_tostring(L, -1);
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", tmp, strerror(errno));
+    return 2;
+  }
+  char head[SNAPHEAD];
+  unsigned long long bits;
+  memcpy(head, snap_magic, 8);
+  memcpy(&bits, &mtime, 8);
+  snap_le(head + 8, bits, 8);
+  snap_le(head + 16, (unsigned long long) size, 8);
+  snap_le(head + 24, (unsigned long long) (unsigned int) mode, 4);
+  fwrite(head, 1, SNAPHEAD, f);
+  size_t i, n = lua_rawlen(L, 7), len;
+  snap_fput(f, n);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 7, (lua_Integer) i);
+    const char *s = lua_tolstring(L, -1, &len);
+    snap_fput(f, len);
+    fwrite(s, 1, len, f);
+    lua_pop(L, 1);
+  }
+  fwrite(b->s, 1, b->n, f);
+  if (ferror(f) | fclose(f) || rename(tmp, path)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    remove(tmp);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+typedef struct snap_reader { const char *c, *e; size_t nstr; int bad; } snap_reader;
+
+static size_t snap_get (snap_reader *r) { /* varint */
+  size_t v = 0;
+  int sh;
+  for (sh = 0; r->c < r->e && sh < 64; sh += 7) {
+    unsigned char ch = (unsigned char) *r->c++;
+    v |= (size_t) (ch & 0x7f) << sh;
+    if (!(ch & 0x80)) return v;
+  }
+  r->bad = 1;
+  return 0;
+}
+
+static void snap_push (lua_State *L, snap_reader *r, int strs) { /* string by index; 0: true */
+  size_t i = snap_get(r);
+  if (i > r->nstr) r->bad = 1;
+  if (i && !r->bad) lua_rawgeti(L, strs, (lua_Integer) i); else lua_pushboolean(L, 1);
+}
+
+static int lsmp_restore (lua_State *L) { /* --> root; or nil, msg ('stale' if not of mtime, size, mode) */
+  const char *path = luaL_checkstring(L, 1);
+  int check = !lua_isnoneornil(L, 3), i;
+  double mtime = (double) luaL_optnumber(L, 3, 0);
+  long long size = (long long) luaL_optinteger(L, 4, 0), hsize;
+  int mode = (int) luaL_optinteger(L, 5, 0x0f), hmode;
+  lua_settop(L, 2);
+  if (lua_isnil(L, 2)) {
+    lua_newtable(L);
+    lua_replace(L, 2);
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lsmp_map *b = map_file(L, path); /* 3 */
+  if (!b) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+  if (b->f) map_read(b, 1);
+  snap_reader r = {b->s, b->s + b->n, 0, 0};
+  double hmtime;
+  if (b->n < SNAPHEAD || memcmp(b->s, snap_magic, 4)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: not a snapshot", path);
+    return 2;
+  }
+  if (memcmp(b->s, snap_magic, 8)) { /* fields of other widths */
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: snapshot of another layout", path);
+    return 2;
+  }
+  unsigned long long bits = snap_unle(b->s + 8, 8);
+  memcpy(&hmtime, &bits, 8);
+  hsize = (long long) snap_unle(b->s + 16, 8);
+  hmode = (int) (unsigned int) snap_unle(b->s + 24, 4);
+  if (check && (hmtime != mtime || hsize != size || hmode != mode)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "stale");
+    return 2;
+  }
+  r.c += SNAPHEAD;
+  r.nstr = snap_get(&r);
+  if (r.nstr > (size_t) (r.e - r.c)) r.bad = 1; /* at least a byte each */
+  lua_createtable(L, r.bad ? 0 : (int) r.nstr, 0); /* 4: strings */
+  for (i = 1; !r.bad && i <= (int) r.nstr; i++) {
+    size_t len = snap_get(&r);
+    if (len > (size_t) (r.e - r.c)) r.bad = 1;
+    else {
+      lua_pushlstring(L, r.c, len);
+      lua_rawseti(L, 4, i);
+      r.c += len;
+    }
+  }
+
+  lsmp_dom *d = (lsmp_dom *) lua_newuserdata(L, sizeof(lsmp_dom)); /* 5 */
+  d->parser = NULL;
+  d->n = (int *) malloc(sizeof(int) * (d->size = 16));
+  luaL_setmetatable(L, DomType);
+  d->L = L;
+  d->base = 6;
+  d->depth = -1; /* root to come */
+  lua_pushvalue(L, 2); /* 6: root, then the open elements */
+  while (!r.bad) {
+    int top = d->base + d->depth, k;
+    switch (snap_get(&r)) {
+      case 0: /* end */
+        if (d->depth > 0) dom_pop(d);
+        else { d->depth = -2; r.bad = r.c != r.e; }
+        break;
+      case 1: { /* element */
+        size_t name = snap_get(&r), n = snap_get(&r), na = snap_get(&r);
+        if (na > (size_t) (r.e - r.c) || name > r.nstr) { r.bad = 1; break; }
+        if (d->depth >= 0) {
+          lua_createtable(L, n > (size_t) (r.e - r.c) ? 0 : (int) n, 2);
+          luaL_checkstack(L, 8, "lsmp.restore: too deep");
+        }
+        else lua_pushvalue(L, 2);
+        if (name) {
+          lua_rawgeti(L, 4, (lua_Integer) name);
+          lua_setfield(L, -2, ".");
+        }
+        if (na) lua_createtable(L, 0, (int) na);
+        for (k = 0; k < (int) na && !r.bad; k++) {
+          snap_push(L, &r, 4);
+          snap_push(L, &r, 4);
+          lua_rawset(L, -3);
+        }
+        size_t no = snap_get(&r);
+        if (no > (size_t) (r.e - r.c)) { r.bad = 1; no = 0; }
+        if (no && !na) lua_createtable(L, (int) no, 0);
+        for (k = 1; k <= (int) no && !r.bad; k++) {
+          snap_push(L, &r, 4);
+          lua_rawseti(L, -2, k);
+        }
+        if (na || no) lua_setfield(L, -2, "@");
+        if (d->depth < 0) {
+          lua_pop(L, 1);
+          d->depth = 0;
+          d->n[0] = (int) luaL_len(L, d->base);
+        }
+        else {
+          if (++d->depth == d->size) d->n = (int *) realloc(d->n, sizeof(int) * (d->size *= 2));
+          d->n[d->depth] = 0;
+        }
+        break;
+      }
+      case 2: /* text */
+        snap_push(L, &r, 4);
+        if (d->depth < 0) r.bad = 1; else dom_append(d);
+        break;
+      case 3: { /* scheme */
+        if (d->depth < 0) { r.bad = 1; break; }
+        if (lua_getfield(L, top, "+") == LUA_TNIL || !lua_toboolean(L, -1)) {
+          lua_pop(L, 1);
+          lua_newtable(L);
+          lua_pushvalue(L, -1);
+          lua_setfield(L, top, "+");
+        }
+        lua_newtable(L);
+        snap_push(L, &r, 4);
+        lua_rawseti(L, -2, 0);
+        size_t n = snap_get(&r);
+        for (k = 1; k <= (int) n && !r.bad && r.c < r.e; k++) {
+          snap_push(L, &r, 4);
+          lua_rawseti(L, -2, k);
+        }
+        lua_rawseti(L, -2, (lua_Integer) lua_rawlen(L, -2) + 1);
+        lua_pop(L, 1);
+        break;
+      }
+      case 4: /* error */
+        if (d->depth < 0) { r.bad = 1; break; }
+        if (lua_getfield(L, top, "?") == LUA_TNIL || !lua_toboolean(L, -1)) {
+          lua_pop(L, 1);
+          lua_newtable(L);
+          lua_pushvalue(L, -1);
+          lua_setfield(L, top, "?");
+        }
+        snap_push(L, &r, 4);
+        lua_rawseti(L, -2, (lua_Integer) lua_rawlen(L, -2) + 1);
+        lua_pop(L, 1);
+        break;
+      default: r.bad = 1;
+    }
+    if (d->depth == -2) break;
+  }
+  dom_free(d);
+  if (r.bad) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: corrupt snapshot", path);
+    return 2;
+  }
+  lua_pushvalue(L, 2);
+  return 1;
+} /* }}} */
+
+static int lsmp_stat (lua_State *L) { /* lsmp.stat(path) --> mtime, size; or nil, msg */
+  const char *path = luaL_checkstring(L, 1);
+  struct stat st;
+  if (stat(path, &st)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+  lua_pushnumber(L, (lua_Number) st.st_mtim.tv_sec + st.st_mtim.tv_nsec * 1e-9);
+  lua_pushinteger(L, (lua_Integer) st.st_size);
+  return 2;
+}
 
 static const struct luaL_Reg parser_meths[] = {
   {"parse", lsmp_parse},
+  {"parseall", lsmp_parseall},
   {"close", lsmp_close},
   {"pos", lsmp_pos},
   {"getcallbacks", getcallbacks},
+  {"rebind", lsmp_rebind},
+  {"events", lsmp_events}, /* [s] --> iterator of ev, name, data */
+  {"attr", lsmp_attr},
   {"__gc", lsmp_close},
   {NULL, NULL}
 };
 
 static const struct luaL_Reg lsmp_funcs[] = {
   {"new", lsmp_creator}, /* cbt (callback table) */
+  {"dom", lsmp_builddom}, /* s, mode, singleton, root, skip */
+  {"domfile", lsmp_domfile}, /* path, mode, singleton, root, skip */
+  {"encode", lsmp_encode}, /* s --> gzip -c | base64 -w 128 */
+  {"decode", lsmp_decode}, /* base64 -i -d | zcat -f */
+  {"load", lsmp_loadfiles}, /* files, mode, singleton, roots, threads */
+  {"stat", lsmp_stat}, /* path --> mtime, size */
+  {"save", lsmp_save}, /* tree, path, mtime, size, mode: snapshot */
+  {"restore", lsmp_restore}, /* path, root, mtime, size, mode --> root */
+  {"lazy", lsmp_lazy}, /* s, mode, singleton, root, skip --> root, arena */
+  {"lazyfile", lsmp_lazyfile}, /* path, mode, singleton, root, skip --> root, arena */
+  {"view", lsmp_view}, /* node --> table, the proxy of a lazy dom not made */
   {NULL, NULL}
 };
 
 static const struct luaL_Reg lsmp_mt[] = {
   {"__call", lsmp_wraper}, /* lsmp, cbt */
-  {"__gc", lsmp_gc}, /* clean stack */
   {NULL, NULL}
 };
 
@@ -681,6 +3345,26 @@ LUA_API int luaopen_lsmp (lua_State *L) {
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index"); /* merged into metatable */
   lua_pop (L, 1); /* remove parser type metatable */
+  luaL_newmetatable(L, DomType); /* dom builder */
+  lua_pushcfunction(L, lsmp_domgc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LoadType); /* records of lsmp.load */
+  lua_pushcfunction(L, lsmp_loadgc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LazyType); /* lazy dom arena */
+  lua_pushcfunction(L, lsmp_lazygc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  lua_pushcfunction(L, lazy_find);
+  lua_setfield(L, -2, "find");
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, MapType); /* mapped file/buffer */
+  lua_pushcfunction(L, lsmp_mapgc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
 
   luaL_newlib(L, lsmp_funcs); /* the module table */
   luaL_newlib(L, lsmp_mt);    /* the module metatable */
@@ -691,4 +3375,5 @@ LUA_API int luaopen_lsmp (lua_State *L) {
   lua_setfield(L, -2, "lic");
   return 1;
 } /* }}} */
+#endif
 // vim:ts=2:sw=2:sts=2:et:fdm=marker:fdl=1
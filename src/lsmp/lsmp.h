@@ -16,13 +16,24 @@ typedef __uint8_t  BYTE;
 #define CommentKey        "Comment"
 #define ExtensionKey      "Extension"
 #define ClosingKey        "Closing"
+#define EventsKey         "Events"
 
-typedef void (*SML_SchemeHdlr)       (void *ud, const char *name, const char **atts);
-typedef void (*SML_StartElementHdlr) (void *ud, const char *name, const char **atts);
-typedef void (*SML_EndElementHdlr)   (void *ud, const char *name);
+typedef struct SML_Str { const char *s; int len; } SML_Str; /* not NUL-terminated */
+
+enum SML_Type { SML_SCHEME, SML_START, SML_END, SML_TEXT, SML_COMMENT, SML_EXT, SML_CLOSING }; /* events */
+
+typedef struct SML_Event { /* SML_Next: valid till the next call */
+  int type;
+  SML_Str name, data;      /* name: tag, scheme or extension; data: text, comment or extension body */
+  const SML_Str *attrs;    /* Start (pairs if p->pairs) or Scheme, NULL-terminated */
+} SML_Event;
+
+typedef void (*SML_SchemeHdlr)       (void *ud, SML_Str name, const SML_Str *atts);
+typedef void (*SML_StartElementHdlr) (void *ud, SML_Str name, const SML_Str *atts);
+typedef void (*SML_EndElementHdlr)   (void *ud, SML_Str name);
 typedef void (*SML_CharDataHdlr)     (void *ud, const char *s, int len);
 typedef void (*SML_CommentHdlr)      (void *ud, const char *s, int len);
-typedef void (*SML_ExtensionHdlr)    (void *ud, const char *name, const char *s, int len);
+typedef void (*SML_ExtensionHdlr)    (void *ud, SML_Str name, const char *s, int len);
 typedef void (*SML_ClosingHdlr)      (void *ud);
 
 /* mode */
@@ -31,6 +42,13 @@ typedef void (*SML_ClosingHdlr)      (void *ud);
 #define M_SLOPPY    0x02 /* <_ _> */
 #define M_MISC      0x04 /* TODO */
 #define M_MODES     0x07
+#define M_LAZY      0x80 /* line/column on demand (SML_ParserCreate only) */
+/* eager and M_LAZY positions agree: the '/' of <x/> is counted once; earlier eager
+** counts took it twice, so the column and byte after such a tag were one more */
+
+#define SML_CHUNK   8192 /* default hint */
+#define SML_SPLIT   (1 << 20) /* least bytes a thread of SML_ParseThreads */
+#define SML_ARENA   1024 /* first arena block */
 
 /* flag */
 #define F_TOKEN     0x08 /* tag name found */
@@ -43,16 +61,37 @@ typedef void (*SML_ClosingHdlr)      (void *ud);
 #define S_STRING    0x40 /* in MARKUP */
 #define S_ERROR     0x50
 #define S_DONE      0x60
+#define S_SKIP      0x70 /* inside a skipped element */
 #define S_STATES    0xF0
 
-typedef struct Glnk Glnk;
-struct Glnk { Glnk *next; void *data; };
+typedef struct SML_Blk SML_Blk; /* arena block */
+struct SML_Blk { SML_Blk *next; unsigned int size, used; char data[]; };
+
+typedef struct SML_Tok { unsigned int off; int len; } SML_Tok; /* off: from buf[0] */
+
+typedef struct SML_Ext { char ch; BYTE ext; WORD child, next; } SML_Ext; /* opener trie; ext: pair + 1 */
+
+/* character class */
+#define C_SPACE     0x01 /* <= ' ' */
+#define C_DEL       0x02
+#define C_QUOTE     0x04 /* " ' */
+#define C_LT        0x08
+#define C_GT        0x10
+#define C_NAME      0x20 /* _ A-Z a-z: regular tag */
+#define C_TAG       0x40 /* after <, markup (any if not sloppy) */
 
 typedef struct SML_ParserStruct {
   void *ud;                /* userdata */
   char *buf;
-  unsigned int len, size;
+  unsigned int off, len;   /* pending data: buf[off] .. buf[off + len - 1] */
+  unsigned int rest;       /* then not scanned yet: stopped with events to pull, or by budget */
+  unsigned int size, hint; /* allocated, and the first allocation (chunk size) */
+  unsigned int budget;     /* bytes scanned per SML_Parse call, 0: all */
   unsigned int r, c, i, n; /* row, column, byte index, pre-col */
+  unsigned int base, at;   /* byte index of buf[0] and of the cursor (lazy) */
+  BYTE lazy;               /* r/c/i/n are only brought up to date on demand */
+  BYTE zc;                 /* buf is the caller's document (SML_ParseBuffer) */
+  BYTE pairs;              /* start tag atts as key/value pairs, unquoted */
   SML_CharDataHdlr     ft; /* text <!CDATA[ ]]> */
   SML_StartElementHdlr fs; /* markup tag start */
   SML_EndElementHdlr   fe; /* markup tag end */
@@ -68,26 +107,49 @@ typedef struct SML_ParserStruct {
   char *lszExts;       /* length of closing token */
   BYTE Exts;           /* # of pairs */
   BYTE iExt;           /* found index */
+  SML_Ext *trie;       /* openers without '<', node 0 the root */
+  BYTE cc[256];        /* character classes of the mode */
 
-  char *elem;
-  Glnk *attr;
+  SML_Str elem;
+  SML_Tok *attr;       /* tokens of the open tag, in order */
+  unsigned int nattr, mattr;
+  SML_Blk *arena;      /* element name and attribute vector of the current tag */
   int  level;
+
+  SML_Str *szSkips;    /* elements skipped without events */
+  BYTE Skips;          /* # of names */
+  BYTE skipe;          /* end tag of the skipped element is delivered */
+  BYTE sreq;           /* SML_SkipElement called from the start handler */
+  char *sname;         /* name of the skipped element */
+  unsigned int lsname, msname;
+  unsigned int skip, sm; /* nesting of sname, scan state in the skipped content */
+
+  struct SML_Pull *pull; /* events queued for SML_Next, scanning stops at each */
+  BYTE fin;            /* end of document given */
 } *SML_Parser;
 
-#define SML_GetCurrentLineNumber(p)     ((p)->r)
-#define SML_GetCurrentColumnNumber(p)   ((p)->c)
-#define SML_GetCurrentByteIndex(p)      ((p)->i)
+#define SML_GetCurrentLineNumber(p)     (SML_Locate(p)->r)
+#define SML_GetCurrentColumnNumber(p)   (SML_Locate(p)->c)
+#define SML_GetCurrentByteIndex(p)      (SML_Locate(p)->i)
 
 enum MPState { /* parser status */
   MPSok,       /* state while parsing */
   MPSstring,   /* state while reading a string */
   MPSfinished, /* state after finished parsing */
-  MPSerror
+  MPSerror,
+  MPSsuspended /* budget used: SML_Parse(p, "", 0) resumes */
 };
 
 SML_Parser    SML_ParserCreate (void *ud, int mode, const char *ext);
 enum MPState  SML_Parse        (SML_Parser p, const char *s, int len);
+enum MPState  SML_ParseBuffer  (SML_Parser p, const char *s, int len);
+enum MPState  SML_ParseThreads (SML_Parser p, const char *s, int len, int threads); /* replayed: no positions, no skip requests */
 void          SML_ParserFree   (SML_Parser p);
+SML_Parser    SML_Locate       (SML_Parser p);
+void          SML_SetSkip      (SML_Parser p, const char *names);
+void          SML_SkipElement  (SML_Parser p);
+void          SML_SetPull      (SML_Parser p);
+int           SML_Next         (SML_Parser p, SML_Event *ev);
 
 extern const char *SML_ErrorString[];
 #endif